@@ -6,17 +6,12 @@
  */
 
 #include "zmake_helper.h"
+#include "zmake_internal.h"
 
 using namespace zmake;
 namespace fs = std::filesystem;
 
 namespace zmake {
-    extern std::map<std::string, ZFile*>& GlobalFiles();
-    extern std::string GetBuildPath(const std::string& path);
-    extern ZFile*& AccessFileInternal(const std::string& file, bool create_file = false,
-        bool need_build = false, FileType ft = FT_NONE);
-    extern void ProcessDepsRecursively(const std::vector<ZFile*>& deps,
-            const std::function<void(ZFile*)>& fn, std::set<ZFile*>* uniq_deps = nullptr);
     class ZF {
     public:
         static void ProcessObjectUsers(ZObject* obj) {
@@ -43,6 +38,13 @@ int main(int argc, char* argv[]) {
     auto build_root = *AccessBuildRootDir();
 
     SetVerboseMode(CommandArgs::Has("-v"));
+    SetKeepGoingMode(CommandArgs::Has("-k") || CommandArgs::Has("--keep-going"));
+    SetExplainMode(CommandArgs::Has("--explain"));
+    if (CommandArgs::Has("--fast-link")) EnableFastLink();
+    if (CommandArgs::Has("--time-trace")) EnableTimeTrace();
+    if (CommandArgs::Has("--variants")) {
+        SetBuildVariants(StringSplit(CommandArgs::Get<std::string>("--variants"), ','));
+    }
     if (CommandArgs::Has("-d")) {
         int debug_level = 1;
         try { debug_level = CommandArgs::Get<int>("-d"); } catch (...) {}
@@ -56,17 +58,19 @@ int main(int argc, char* argv[]) {
     }
 
     for (auto x : BuilderBase::GlobalBuilders()) {
-        auto old_cwd = fs::current_path();
+        //the building rules of external projects are run by BuildExternalZmakeProject
+        if (StringBeginWith(x.first, build_root + ".external/")) continue;
+        auto old_cwd = GetCurrentDir();
         const std::string prj_inner_path = fs::path(x.first).parent_path().lexically_relative(build_root);
         fs::path p(prj_root + prj_inner_path);
-        fs::current_path(p);
+        ChangeCurrentDir(p);
 
         auto builder = (x.second)();
         ColorPrint(StringPrintf("* Start to analyze targets under the directory %s\n", p.string().data()), CT_BRIGHT_CYAN);
         builder->Run();
         delete builder;
 
-        fs::current_path(old_cwd);
+        ChangeCurrentDir(old_cwd);
     }
 
     if (CommandArgs::Has("-l")) {
@@ -93,12 +97,21 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    if (CommandArgs::Has("-H")) {
+        size_t top_n = 20;
+        try { top_n = CommandArgs::Get<size_t>("-H", 20); } catch (...) {}
+        ReportHeaderCosts(top_n);
+        return 0;
+    }
+
     for (auto t : StringSplit(CommandArgs::Get<std::string>("-t", ""), ';')) {
         ZFile* f = nullptr;
         if (StringEndWith(t, ".o") && '/' != *t.rbegin()) f = AddTarget(GetBuildPath(t));
         else f = AddTarget(t);
         if (StringEndWith(t, C_CPP_SOURCE_SUFFIXES)) {
-            f = AddTarget(GetBuildPath(StringReplaceSuffix(t, C_CPP_SOURCE_SUFFIXES, ".o")));
+            //the obj of a module interface unit keeps its suffix, e.g.: "a.cppm" -> "a.cppm.o"
+            f = AddTarget(GetBuildPath(StringEndWith(t, CPP_MODULE_SUFFIXES) ? t + ".o" :
+                    StringReplaceSuffix(t, C_CPP_SOURCE_SUFFIXES, ".o")));
         }
         if (FT_OBJ_FILE == f->GetFileType()) ZF::ProcessObjectUsers((ZObject*)f);
     }
@@ -109,6 +122,7 @@ int main(int argc, char* argv[]) {
 
     ColorPrint("* Start to build all targets\n", CT_BRIGHT_CYAN);
     BuildAll(CommandArgs::Has("-e"), CommandArgs::Get<int>("-j", -1));
+    if (CommandArgs::Has("--explain")) return 0;
     ColorPrint("* Start to install all targets\n", CT_BRIGHT_CYAN);
     InstallAll();
     return 0;
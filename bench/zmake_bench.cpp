@@ -0,0 +1,360 @@
+/*
+ * zmake_bench.cpp
+ *
+ *  Benchmark of zmake itself: synthesize a zmake project with the configurable shape, then time
+ *  the analysis, clean build, no-op build and single-header-edit rebuild of it, and write the
+ *  results into a JSON file.
+ *
+ *  The compilers of the synthesized project are this binary itself in stub mode(see RunStub),
+ *  so what is measured is zmake rather than g++.
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <climits>
+#include <chrono>
+#include <random>
+#include <unordered_set>
+
+#include "../zmake_util.h"
+
+using namespace zmake;
+namespace fs = std::filesystem;
+
+namespace {
+
+//stub mode: it's used as the compiler, archiver, linker and protoc of the synthesized project, which
+//writes the outputs(and the '.d' file for compiling) without really compiling anything; the content
+//of an output is the hash of its inputs, so that an output only changes if any input changes, which
+//is the same as the real compilers
+std::string HashFiles(const std::vector<std::string>& files) {
+    size_t h = 0;
+    for (const auto& f : files) h = h * 31 + std::hash<std::string>()(f + StringFromFile(f));
+    return StringPrintf("%016zx\n", h);
+}
+
+void CollectIncludes(const std::string& file, const std::vector<std::string>& inc_dirs,
+        std::vector<std::string>* deps, std::unordered_set<std::string>* visited) {
+    static const std::regex s_inc_reg("^\\s*#\\s*include\\s*\"([^\"]+)\"");
+    std::istringstream iss(StringFromFile(file));
+    std::smatch m;
+    for (std::string line; std::getline(iss, line); ) {
+        if (!std::regex_search(line, m, s_inc_reg)) continue;
+        std::vector<std::string> candidates = {GetDirnameFromPath(file) + m[1].str()};
+        for (const auto& dir : inc_dirs) candidates.push_back(dir + "/" + m[1].str());
+        for (const auto& c : candidates) {
+            if (!fs::exists(c)) continue;
+            auto p = fs::path(c).lexically_normal().string();
+            if (visited->insert(p).second) {
+                deps->push_back(p);
+                CollectIncludes(p, inc_dirs, deps, visited);
+            }
+            break;
+        }
+    }
+}
+
+int RunStub(int argc, char* argv[]) {
+    std::string out, dep_file, cpp_out;
+    std::vector<std::string> inc_dirs, inputs;
+    bool compile = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ("-o" == arg && i + 1 < argc) out = argv[++i];
+        else if ("-MF" == arg && i + 1 < argc) dep_file = argv[++i];
+        else if ("-c" == arg) compile = true;
+        else if ("-isystem" == arg || "-idirafter" == arg || "-iquote" == arg) inc_dirs.push_back(argv[++i]);
+        else if ("-include" == arg || "-x" == arg || "-MT" == arg) ++i;
+        else if (StringBeginWith(arg, "--cpp_out=")) cpp_out = arg.substr(strlen("--cpp_out="));
+        else if (StringBeginWith(arg, "-I") && arg.size() > 2) inc_dirs.push_back(arg.substr(2));
+        else if ('-' != arg.at(0)) inputs.push_back(arg);
+    }
+
+    if ("" != cpp_out) {
+        //protoc: the '.pb.h' and '.pb.cc' are located by the path relative to the first import dir
+        for (const auto& proto : inputs) {
+            auto rel = fs::path(proto).lexically_relative(inc_dirs.at(0)).string();
+            auto base = cpp_out + "/" + StringReplaceSuffix(rel, ".proto", "");
+            fs::create_directories(GetDirnameFromPath(base));
+            std::string hdr = "#pragma once\n";
+            static const std::regex s_import_reg("import\\s+\"([^\"]+)\\.proto\"");
+            auto content = StringFromFile(proto);
+            for (std::sregex_iterator it(content.begin(), content.end(), s_import_reg), end; it != end; ++it) {
+                hdr += "#include \"" + (*it)[1].str() + ".pb.h\"\n";
+            }
+            StringToFile(hdr + "//" + HashFiles({proto}), base + ".pb.h");
+            StringToFile("#include \"" + StringReplaceSuffix(rel, ".proto", ".pb.h") + "\"\n", base + ".pb.cc");
+        }
+        return 0;
+    }
+
+    if (compile) {
+        std::vector<std::string> deps = inputs;
+        std::unordered_set<std::string> visited;
+        for (const auto& src : inputs) CollectIncludes(src, inc_dirs, &deps, &visited);
+        if ("" != dep_file) StringToFile(out + ": " + StringCompose(deps, ' ') + "\n", dep_file);
+        return StringToFile(HashFiles(deps), out) ? 0 : 1;
+    }
+
+    //linking a binary, the inputs are objs and libs
+    return StringToFile(HashFiles(inputs), out) ? 0 : 1;
+}
+
+struct Shape {
+    int packages = 20;
+    int srcs = 10;         //sources(and headers) per package
+    int src_includes = 4;  //headers included by each source, i.e.: the fan-in of headers
+    int hdr_includes = 2;  //headers included by each header, i.e.: the fan-out of headers
+    int protos = 1;        //protos per package
+    int depth = 4;         //layers of packages, each package depends on the ones of its lower layer
+    bool glob = false;     //use Glob in BUILD.inc instead of listing the files explicitly
+    int seed = 1;
+};
+
+struct ProjectStats {
+    size_t files = 0;
+    size_t sources = 0;
+    size_t headers = 0;
+    size_t protos = 0;
+    std::string edited_header;
+};
+
+std::string PkgName(int idx) { return StringPrintf("p%04d", idx); }
+
+ProjectStats GenerateProject(const Shape& shape, const std::string& root, const std::string& stub) {
+    std::mt19937 rng(shape.seed);
+    auto rand_fn = [&rng](int n) { return (int)(rng() % std::max(n, 1)); };
+    ProjectStats stats;
+    auto write_fn = [&stats](const std::string& str, const std::string& file) {
+        fs::create_directories(GetDirnameFromPath(file));
+        StringToFile(str, file);
+        ++stats.files;
+    };
+
+    //'.cc' is for the '.pb.cc' files
+    write_fn(StringPrintf("*AccessDefaultCompiler(\".cpp\") = \"%s\";\n"
+            "*AccessDefaultCompiler(\".cc\") = \"%s\";\n"
+            "*AccessDefaultCompiler(\".proto\") = \"%s\";\n"
+            "*AccessDefaultCompiler(\"\") = \"%s\";\n", stub.data(), stub.data(), stub.data(), stub.data()),
+            root + "BUILD.inc");
+
+    //the packages of layer 'l' are [layer_begin[l], layer_begin[l + 1])
+    const int depth = std::max(1, std::min(shape.depth, shape.packages));
+    std::vector<int> layer_begin;
+    for (int l = 0; l <= depth; ++l) layer_begin.push_back(l * shape.packages / depth);
+    std::vector<std::vector<int>> pkg_deps(shape.packages);
+    for (int l = 1; l < depth; ++l) {
+        for (int p = layer_begin[l]; p < layer_begin[l + 1]; ++p) {
+            int lower_size = layer_begin[l] - layer_begin[l - 1];
+            for (int k = 0; k < std::min(2, lower_size); ++k) {
+                int dep = layer_begin[l - 1] + (p + k) % lower_size;
+                pkg_deps[p].push_back(dep);
+            }
+        }
+    }
+
+    auto hdr_fn = [](int pkg, int idx) { return StringPrintf("pkgs/%s/h%03d.h", PkgName(pkg).data(), idx); };
+    auto proto_fn = [](int pkg, int idx) { return StringPrintf("pkgs/%s/%s_%d", PkgName(pkg).data(), PkgName(pkg).data(), idx); };
+    for (int p = 0; p < shape.packages; ++p) {
+        const auto dir = root + "pkgs/" + PkgName(p) + "/";
+        //the headers visible for this package: its own ones and the ones of the packages it depends on
+        std::vector<std::string> visible_hdrs;
+        for (auto dep : pkg_deps[p]) for (int i = 0; i < shape.srcs; ++i) visible_hdrs.push_back(hdr_fn(dep, i));
+        for (auto dep : pkg_deps[p]) for (int i = 0; i < shape.protos; ++i) visible_hdrs.push_back(proto_fn(dep, i) + ".pb.h");
+
+        for (int i = 0; i < shape.srcs; ++i) {
+            std::string hdr = "#pragma once\n";
+            for (int k = 0; k < shape.hdr_includes && i > 0; ++k) {
+                hdr += "#include \"" + hdr_fn(p, rand_fn(i)) + "\"\n";
+            }
+            hdr += StringPrintf("int %s_f%d();\n", PkgName(p).data(), i);
+            write_fn(hdr, root + hdr_fn(p, i));
+            ++stats.headers;
+
+            std::string src = "#include \"" + hdr_fn(p, i) + "\"\n";
+            for (int k = 0; k < shape.src_includes; ++k) {
+                if (!visible_hdrs.empty() && k % 2 == 0) {
+                    src += "#include \"" + visible_hdrs[rand_fn(visible_hdrs.size())] + "\"\n";
+                } else {
+                    src += "#include \"" + hdr_fn(p, rand_fn(shape.srcs)) + "\"\n";
+                }
+            }
+            for (int k = 0; k < shape.protos; ++k) src += "#include \"" + proto_fn(p, k) + ".pb.h\"\n";
+            src += StringPrintf("int %s_f%d() { return %d; }\n", PkgName(p).data(), i, i);
+            write_fn(src, dir + StringPrintf("s%03d.cpp", i));
+            ++stats.sources;
+        }
+
+        for (int i = 0; i < shape.protos; ++i) {
+            std::string proto = "syntax = \"proto3\";\n";
+            for (auto dep : pkg_deps[p]) proto += "import \"" + proto_fn(dep, 0) + ".proto\";\n";
+            proto += StringPrintf("message M%d {}\n", i);
+            write_fn(proto, root + proto_fn(p, i) + ".proto");
+            ++stats.protos;
+        }
+
+        std::string rules;
+        std::vector<std::string> dep_libs;
+        if (shape.protos > 0) {
+            std::vector<std::string> protos;
+            for (int i = 0; i < shape.protos; ++i) protos.push_back("\"" + GetFilenameFromPath(proto_fn(p, i)) + ".proto\"");
+            std::vector<std::string> proto_deps;
+            for (auto dep : pkg_deps[p]) proto_deps.push_back("\"/pkgs/" + PkgName(dep) + "/" + PkgName(dep) + "_proto\"");
+            rules += StringPrintf("AccessLibrary(\"%s_proto\")->AddProtos(%s)%s;\n", PkgName(p).data(),
+                    shape.glob ? "Glob({\"*.proto\"})" : ("{" + StringCompose(protos, ',') + "}").data(),
+                    proto_deps.empty() ? "" : ("->AddDepLibs({" + StringCompose(proto_deps, ',') + "})").data());
+            dep_libs.push_back("\"" + PkgName(p) + "_proto\"");
+        }
+        for (auto dep : pkg_deps[p]) dep_libs.push_back("\"/pkgs/" + PkgName(dep) + "/" + PkgName(dep) + "\"");
+        std::vector<std::string> srcs;
+        for (int i = 0; i < shape.srcs; ++i) srcs.push_back(StringPrintf("\"s%03d.cpp\"", i));
+        rules += StringPrintf("AccessLibrary(\"%s\")->AddObjs(%s)%s;\n", PkgName(p).data(),
+                shape.glob ? "Glob({\"*.cpp\"})" : ("{" + StringCompose(srcs, ',') + "}").data(),
+                dep_libs.empty() ? "" : ("->AddDepLibs({" + StringCompose(dep_libs, ',') + "})").data());
+        write_fn(rules, dir + "BUILD.inc");
+    }
+
+    //one binary for each package of the top layer
+    std::string rules;
+    for (int p = layer_begin[depth - 1]; p < shape.packages; ++p) {
+        write_fn(StringPrintf("#include \"%s\"\nint main() { return %s_f0(); }\n",
+                hdr_fn(p, 0).data(), PkgName(p).data()), root + "app/" + PkgName(p) + ".cpp");
+        rules += StringPrintf("AccessBinary(\"%s\")->AddObjs({\"%s.cpp\"})->AddDepLibs({\"/pkgs/%s/%s\"});\n",
+                PkgName(p).data(), PkgName(p).data(), PkgName(p).data(), PkgName(p).data());
+    }
+    write_fn(rules, root + "app/BUILD.inc");
+
+    //the first header of the bottom layer is the one with the most users
+    stats.edited_header = root + hdr_fn(0, 0);
+    return stats;
+}
+
+struct PhaseResult {
+    std::string name;
+    int exit_code = 0;
+    double wall_ms = 0;
+    long max_rss_kb = 0;
+};
+
+//run 'args' under 'cwd' with the output redirected into 'log', and measure its wall time and peak RSS
+PhaseResult RunPhase(const std::string& name, const std::vector<std::string>& args,
+        const std::string& cwd, const std::string& log) {
+    PhaseResult res;
+    res.name = name;
+    auto tm_start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (0 == pid) {
+        if (0 != chdir(cwd.data())) _exit(127);
+        int fd = open(log.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        std::vector<char*> argv;
+        for (auto& a : args) argv.push_back(const_cast<char*>(a.data()));
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    res.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tm_start).count();
+    res.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    res.max_rss_kb = usage.ru_maxrss;
+    ColorPrint(StringPrintf("* %-20s %10.1f ms %8ld KB %s\n", name.data(), res.wall_ms, res.max_rss_kb,
+            0 == res.exit_code ? "" : StringPrintf("FAILED(%d), see %s", res.exit_code, log.data()).data()),
+            0 == res.exit_code ? CT_BRIGHT_CYAN : CT_BRIGHT_RED);
+    return res;
+}
+
+} //end of anonymous namespace
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string("--stub") == argv[1]) return RunStub(argc, argv);
+
+    CommandArgs::Init(argc, argv);
+    if (CommandArgs::Has("-h")) {
+        printf("Usage: %s [OPTION]...\n"
+               "  Synthesize a zmake project and benchmark zmake on it, the results are written as JSON.\n"
+               "\n"
+               "Options:\n"
+               "  --packages \t number of packages, 20 by default;\n"
+               "  --srcs \t number of sources(and headers) per package, 10 by default;\n"
+               "  --src-includes \t headers included by each source(the fan-in of headers), 4 by default;\n"
+               "  --hdr-includes \t headers included by each header(the fan-out of headers), 2 by default;\n"
+               "  --protos \t number of protos per package, 1 by default;\n"
+               "  --depth \t layers of packages, each one depends on the lower layer, 4 by default;\n"
+               "  --glob \t use Glob in BUILD.inc instead of listing the files explicitly;\n"
+               "  --seed \t seed of the random generator, 1 by default;\n"
+               "  --dir \t where the project is synthesized, '/tmp/zmake_bench/' by default;\n"
+               "  --zmake \t the zmake to benchmark, 'zmake' in PATH by default;\n"
+               "  --out \t the JSON result file, 'bench_result.json' by default;\n"
+               "  -j \t concurrency, passed to zmake;\n", CommandArgs::Arg0());
+        return 0;
+    }
+
+    Shape shape;
+    shape.packages = CommandArgs::Get<int>("--packages", shape.packages);
+    shape.srcs = CommandArgs::Get<int>("--srcs", shape.srcs);
+    shape.src_includes = CommandArgs::Get<int>("--src-includes", shape.src_includes);
+    shape.hdr_includes = CommandArgs::Get<int>("--hdr-includes", shape.hdr_includes);
+    shape.protos = CommandArgs::Get<int>("--protos", shape.protos);
+    shape.depth = CommandArgs::Get<int>("--depth", shape.depth);
+    shape.glob = CommandArgs::Has("--glob");
+    shape.seed = CommandArgs::Get<int>("--seed", shape.seed);
+    if (shape.packages <= 0 || shape.srcs <= 0) ZTHROW("--packages and --srcs should be positive");
+    auto root = fs::absolute(CommandArgs::Get<std::string>("--dir", "/tmp/zmake_bench/")).lexically_normal().string();
+    if ('/' != *root.rbegin()) root += "/";
+    const auto zmake = CommandArgs::Get<std::string>("--zmake", "zmake");
+    const auto out = CommandArgs::Get<std::string>("--out", "bench_result.json");
+    const auto jobs = StringPrintf("-j%d", CommandArgs::Get<int>("-j", 0));
+    const auto stub = fs::canonical("/proc/self/exe").string() + " --stub";
+
+    if (fs::exists(root + "BUILD.inc") || fs::exists(root + ".zmade")) fs::remove_all(root);
+    auto tm_start = std::chrono::steady_clock::now();
+    auto stats = GenerateProject(shape, root, stub);
+    double gen_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tm_start).count();
+    ColorPrint(StringPrintf("* generated %zu files(%zu sources, %zu headers, %zu protos) under %s in %.1f ms\n",
+            stats.files, stats.sources, stats.headers, stats.protos, root.data(), gen_ms), CT_BRIGHT_GREEN);
+
+    std::vector<PhaseResult> phases;
+    auto log_fn = [&root](const std::string& name) { return root + "bench_" + name + ".log"; };
+    //compile the building rules into BUILD.exe, which isn't the target of this benchmark
+    phases.push_back(RunPhase("build_exe", {zmake, "-n", jobs}, root, log_fn("build_exe")));
+    if (0 == phases.back().exit_code) {
+        //explain mode runs the full analysis, but executes no cmd
+        phases.push_back(RunPhase("analysis", {"./BUILD.exe", "--explain", jobs}, root, log_fn("analysis")));
+        phases.push_back(RunPhase("clean_build", {"./BUILD.exe", jobs}, root, log_fn("clean_build")));
+        phases.push_back(RunPhase("noop_build", {"./BUILD.exe", jobs}, root, log_fn("noop_build")));
+        StringToFile(StringFromFile(stats.edited_header) + "//edited\n", stats.edited_header);
+        phases.push_back(RunPhase("header_edit_rebuild", {"./BUILD.exe", jobs}, root, log_fn("header_edit_rebuild")));
+    }
+
+    long peak_rss_kb = 0;
+    bool ok = true;
+    std::ostringstream oss;
+    oss << "{\n"
+        << StringPrintf("  \"shape\": {\"packages\": %d, \"srcs\": %d, \"src_includes\": %d, \"hdr_includes\": %d, "
+                "\"protos\": %d, \"depth\": %d, \"glob\": %s, \"seed\": %d},\n", shape.packages, shape.srcs,
+                shape.src_includes, shape.hdr_includes, shape.protos, shape.depth, shape.glob ? "true" : "false",
+                shape.seed)
+        << StringPrintf("  \"project\": {\"files\": %zu, \"sources\": %zu, \"headers\": %zu, \"protos\": %zu, "
+                "\"generate_ms\": %.1f},\n", stats.files, stats.sources, stats.headers, stats.protos, gen_ms)
+        << "  \"phases\": {\n";
+    for (size_t i = 0; i < phases.size(); ++i) {
+        const auto& p = phases[i];
+        oss << StringPrintf("    \"%s\": {\"wall_ms\": %.1f, \"max_rss_kb\": %ld, \"exit_code\": %d}%s\n",
+                p.name.data(), p.wall_ms, p.max_rss_kb, p.exit_code, i + 1 < phases.size() ? "," : "");
+        if ("build_exe" != p.name) peak_rss_kb = std::max(peak_rss_kb, p.max_rss_kb);
+        ok = ok && 0 == p.exit_code;
+    }
+    oss << "  },\n"
+        << StringPrintf("  \"peak_rss_kb\": %ld,\n", peak_rss_kb)
+        << StringPrintf("  \"ok\": %s\n", ok ? "true" : "false")
+        << "}\n";
+    StringToFile(oss.str(), out);
+    ColorPrint(StringPrintf("* results are written into %s\n", out.data()), CT_BRIGHT_GREEN);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,344 @@
+/*
+ * zmake_microbench.cpp
+ *
+ *  Micro-benchmarks of the primitives that run millions of times per analysis: the string helpers of
+ *  zmake_util.h, the path resolution, the config composing, the graph walking and the '.d' parsing.
+ *
+ *  Each benchmark is defined by MICROBENCH(name, max_iterations) { ... }, whose body is timed as one
+ *  iteration, and its untimed preparation can be defined by MICROBENCH_SETUP(name) { ... }; the
+ *  iterations are calibrated to run for '--min-time' seconds at least, and the result is the time per
+ *  iteration. The results can be saved as a baseline(--save=file), and be compared with a saved
+ *  baseline(--baseline=file) to tell the regressions and improvements.
+ */
+
+#include <chrono>
+
+#include "../zmake.h"
+#include "../zmake_util.h"
+#include "../zmake_internal.h"
+
+//the flags building this binary and zmake.cpp, which are recorded into the baseline
+#ifndef MICROBENCH_FLAGS
+#define MICROBENCH_FLAGS "unknown"
+#endif
+
+using namespace zmake;
+namespace fs = std::filesystem;
+
+namespace {
+
+struct MicroBench {
+    std::function<void()> setup; //run once before the calibration, outside the timing
+    std::function<void(size_t)> run; //run the given iterations
+    size_t max_iterations = 0; //0 means unlimited, for the benchmarks consuming prepared inputs
+    static auto& GlobalMicroBenches() {
+        static std::map<std::string, MicroBench> s_benches;
+        return s_benches;
+    }
+};
+
+//keep the compiler from optimizing 'val' out
+template <typename T>
+inline void DoNotOptimize(const T& val) {
+    asm volatile("" : : "r,m"(val) : "memory");
+}
+
+#define MICROBENCH(name, max_iters)                                                                 \
+static void __microbench_##name(size_t __iter);                                                      \
+__attribute__((unused)) __attribute__((constructor)) static void __register_microbench_##name() {   \
+    auto& b = MicroBench::GlobalMicroBenches()[#name];                                                \
+    b.run = [](size_t iters) { for (size_t i = 0; i < iters; ++i) __microbench_##name(i); };          \
+    b.max_iterations = max_iters;                                                                      \
+}                                                                                                      \
+static void __microbench_##name(__attribute__((unused)) size_t __iter)
+
+#define MICROBENCH_SETUP(name)                                                                      \
+static void __microbench_setup_##name();                                                             \
+__attribute__((unused)) __attribute__((constructor)) static void __register_microbench_setup_##name() { \
+    MicroBench::GlobalMicroBenches()[#name].setup = &__microbench_setup_##name;                       \
+}                                                                                                      \
+static void __microbench_setup_##name()
+
+//the realistic inputs, which are prepared under a temporary project dir
+const std::string kCompileCmd = "g++ -c -o /workspace/prj/.zmade/service/core/handler.o -MD -MF "
+        "/workspace/prj/.zmade/service/core/handler.o.d -idirafter /workspace/prj/service/core/ "
+        "-idirafter /workspace/prj/ -idirafter /workspace/prj/.zmade/ -idirafter /workspace/third/boost/include/ "
+        "-idirafter /workspace/third/protobuf/include/ -idirafter /workspace/third/gflags/include/ -std=c++17 "
+        "-O2 -g -Wall -Wextra -fPIC -DNDEBUG -DUSE_GFLAGS -pthread /workspace/prj/service/core/handler.cpp";
+const std::string kSourcePath = "/workspace/prj/service/core/request_handler_impl.cpp";
+const std::string kHeaderPath = "/workspace/prj/service/core/request_handler_impl.h";
+constexpr int kTreeDirs = 20, kTreeFilesPerDir = 25;
+constexpr int kDepFileHeaders = 40, kDepFileIterations = 2000;
+
+MICROBENCH(StringSplit, 0) {
+    DoNotOptimize(StringSplit(kCompileCmd, ' '));
+}
+
+MICROBENCH(StringPrintf, 0) {
+    DoNotOptimize(StringPrintf("%s -c -o %s -MD -MF %s.d", "g++", "/workspace/prj/.zmade/service/core/handler.o",
+            "/workspace/prj/.zmade/service/core/handler.o"));
+}
+
+MICROBENCH(StringBeginWith, 0) {
+    DoNotOptimize(StringBeginWith(kSourcePath, "/workspace/third/|/opt/|/usr/include/|/workspace/prj/"));
+}
+
+MICROBENCH(StringEndWith_Match, 0) {
+    DoNotOptimize(StringEndWith(kSourcePath, C_CPP_SOURCE_SUFFIXES));
+}
+
+MICROBENCH(StringEndWith_Mismatch, 0) {
+    DoNotOptimize(StringEndWith(kHeaderPath, C_CPP_SOURCE_SUFFIXES));
+}
+
+MICROBENCH(ListFilesUnderDir, 0) {
+    DoNotOptimize(ListFilesUnderDir("tree", "^BUILD.inc$", true, true));
+}
+
+MICROBENCH(Glob, 0) {
+    DoNotOptimize(Glob({"**.cpp"}, {"*_test.cpp"}, "tree"));
+}
+
+//the path resolution is memoized, so it's measured by two benchmarks: the warm one rotates over a set of
+//distinct inputs which have been resolved, i.e.: the cache hits of the later lookups during analysis;
+//the cold one resolves a new input in each iteration, i.e.: the first lookup of each input
+constexpr size_t kWarmInputs = 1024, kColdInputs = 50000;
+std::vector<std::string> MakeSourcePaths(const std::string& prefix, size_t n) {
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < n; ++i) {
+        paths.push_back(StringPrintf("%s/m%02zu/sub%02zu/handler_%05zu.cpp", prefix.data(), i % 16,
+                i / 16 % 8, i));
+    }
+    return paths;
+}
+std::vector<std::string> MakeLibNames(const std::string& prefix, size_t n) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < n; ++i) {
+        if (0 == i % 3) names.push_back(StringPrintf("/%s/m%02zu/core:impl_%05zu", prefix.data(), i % 16, i));
+        else if (1 == i % 3) names.push_back(StringPrintf("%s/m%02zu/lib_%05zu", prefix.data(), i % 16, i));
+        else names.push_back(StringPrintf(":lib_%05zu", i));
+    }
+    return names;
+}
+std::vector<std::string>& Inputs(const std::string& name) {
+    static std::map<std::string, std::vector<std::string>> s_inputs;
+    return s_inputs[name];
+}
+
+MICROBENCH_SETUP(FormalizeLibraryName) {
+    Inputs("FormalizeLibraryName") = MakeLibNames("warm", kWarmInputs);
+    for (const auto& name : Inputs("FormalizeLibraryName")) FormalizeLibraryName(name, false);
+}
+MICROBENCH(FormalizeLibraryName, 0) {
+    static const auto& s_names = Inputs("FormalizeLibraryName");
+    DoNotOptimize(FormalizeLibraryName(s_names[__iter % s_names.size()], false));
+}
+
+MICROBENCH_SETUP(FormalizeLibraryName_Cold) {
+    Inputs("FormalizeLibraryName_Cold") = MakeLibNames("cold", kColdInputs);
+}
+MICROBENCH(FormalizeLibraryName_Cold, kColdInputs) {
+    static const auto& s_names = Inputs("FormalizeLibraryName_Cold");
+    static size_t s_next = 0;
+    DoNotOptimize(FormalizeLibraryName(s_names[s_next++], false));
+}
+
+MICROBENCH_SETUP(GetBuildPath) {
+    Inputs("GetBuildPath") = MakeSourcePaths("warm", kWarmInputs);
+    for (const auto& path : Inputs("GetBuildPath")) GetBuildPath(path);
+}
+MICROBENCH(GetBuildPath, 0) {
+    static const auto& s_paths = Inputs("GetBuildPath");
+    DoNotOptimize(GetBuildPath(s_paths[__iter % s_paths.size()]));
+}
+
+//the build dirs of the new paths are created as well, which is a part of the first lookup
+MICROBENCH_SETUP(GetBuildPath_Cold) {
+    Inputs("GetBuildPath_Cold") = MakeSourcePaths("cold", kColdInputs);
+}
+MICROBENCH(GetBuildPath_Cold, kColdInputs) {
+    static const auto& s_paths = Inputs("GetBuildPath_Cold");
+    static size_t s_next = 0;
+    DoNotOptimize(GetBuildPath(s_paths[s_next++]));
+}
+
+MICROBENCH(ZConfig_ToString, 0) {
+    static ZConfig s_conf = [] {
+        ZConfig conf;
+        for (int i = 0; i < 20; ++i) conf.SetFlag(StringPrintf("-DFEATURE_%02d=%d", i, i));
+        return conf;
+    }();
+    DoNotOptimize(s_conf.ToString(DefaultObjectConfig()));
+}
+
+//a graph of 100 objs, each of which depends on 20 of 400 headers, and each header depends on 3 others
+std::vector<ZFile*>& GraphObjs() {
+    static std::vector<ZFile*> s_objs;
+    return s_objs;
+}
+MICROBENCH_SETUP(ProcessDepsRecursively) {
+    std::vector<ZFile*> headers;
+    for (int i = 0; i < 400; ++i) {
+        headers.push_back(AccessFile(StringPrintf("graph/h%03d.h", i), true, FT_HEADER_FILE));
+        for (int k = 1; k <= 3 && i >= k * 7; ++k) headers.back()->AddDep(headers[i - k * 7]);
+    }
+    for (int i = 0; i < 100; ++i) {
+        auto obj = AccessObject(StringPrintf("graph/s%03d.cpp", i));
+        for (int k = 0; k < 20; ++k) obj->AddDep(headers[(i * 37 + k * 13) % headers.size()]);
+        GraphObjs().push_back(obj);
+    }
+}
+MICROBENCH(ProcessDepsRecursively, 0) {
+    size_t n = 0;
+    ProcessDepsRecursively(GraphObjs(), [&n](ZFile* f) { ++n; }, nullptr);
+    DoNotOptimize(n);
+}
+
+//each iteration creates an obj whose '.d' file(generated in the setup) lists 40 headers
+MICROBENCH_SETUP(DepFileParsing) {
+    for (int i = 0; i < kDepFileIterations; ++i) {
+        auto src = StringPrintf("deps/s%04d.cpp", i);
+        auto obj_file = GetBuildPath(fs::absolute(StringReplaceSuffix(src, ".cpp", ".o")));
+        std::string content = obj_file + ": " + fs::absolute(src).string();
+        for (int k = 0; k < kDepFileHeaders; ++k) {
+            content += StringPrintf(" \\\n  %s/deps/inc/h%03d.h", fs::current_path().c_str(), (i + k * 11) % 300);
+        }
+        StringToFile(content + "\n", obj_file + ".d");
+    }
+}
+MICROBENCH(DepFileParsing, kDepFileIterations) {
+    static size_t s_next = 0;
+    DoNotOptimize(AccessObject(StringPrintf("deps/s%04zu.cpp", s_next++)));
+}
+
+//the tree for ListFilesUnderDir and Glob
+void PrepareTree() {
+    for (int d = 0; d < kTreeDirs; ++d) {
+        auto dir = StringPrintf("tree/d%02d/", d);
+        fs::create_directories(dir);
+        StringToFile("", dir + "BUILD.inc");
+        for (int f = 0; f < kTreeFilesPerDir; ++f) {
+            StringToFile("", dir + StringPrintf(f % 5 ? "f%04d.cpp" : "f%04d_test.cpp", f));
+            StringToFile("", dir + StringPrintf("f%04d.h", f));
+        }
+    }
+}
+
+struct Result {
+    size_t iterations = 0;
+    double ns_per_op = 0;
+};
+
+Result RunMicroBench(MicroBench& b, double min_time_s) {
+    if (b.setup) b.setup();
+    auto time_fn = [&b](size_t iters) {
+        auto tm_start = std::chrono::steady_clock::now();
+        b.run(iters);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - tm_start).count();
+    };
+    //grow the iterations(10x at most each round) until one run lasts for 'min_time_s'
+    size_t used = 0, iters = 1;
+    double elapsed = 0;
+    const auto limit = b.max_iterations ? b.max_iterations : SIZE_MAX;
+    while (true) {
+        iters = std::min(iters, limit - used);
+        elapsed = time_fn(iters);
+        used += iters;
+        if (elapsed >= min_time_s || used >= limit) break;
+        double scale = (elapsed > 0) ? std::min(min_time_s * 1.2 / elapsed, 10.0) : 10.0;
+        iters = std::max(iters + 1, (size_t)(iters * scale));
+    }
+    return {iters, iters ? elapsed * 1e9 / iters : 0};
+}
+
+//the first line of the baseline file is the build flags, e.g.: "#flags -O2 -g"
+const std::string kFlagsPrefix = "#flags ";
+std::map<std::string, double> LoadBaseline(const std::string& file, std::string* flags) {
+    std::map<std::string, double> baseline;
+    for (const auto& line : StringSplit(StringFromFile(file), '\n')) {
+        if (StringBeginWith(line, kFlagsPrefix)) {
+            *flags = line.substr(kFlagsPrefix.size());
+            continue;
+        }
+        auto parts = StringSplit(line, ' ');
+        if (2 == parts.size()) baseline[parts[0]] = std::stod(parts[1]);
+    }
+    return baseline;
+}
+
+} //end of anonymous namespace
+
+int main(int argc, char* argv[]) {
+    CommandArgs::Init(argc, argv);
+    if (CommandArgs::Has("-h")) {
+        printf("Usage: %s [OPTION]...\n"
+               "  Run the micro-benchmarks of zmake's primitives.\n"
+               "\n"
+               "Options:\n"
+               "  --filter \t only run the benchmarks whose names match this regex;\n"
+               "  --min-time \t the minimal seconds to run each benchmark, 0.5 by default;\n"
+               "  --save \t save the results into this baseline file;\n"
+               "  --baseline \t compare the results with this baseline file;\n"
+               "  --max-regression \t exit with 1 if any benchmark is slower than the baseline by\n"
+               "     \t more than this percentage, e.g.: --max-regression=20;\n", CommandArgs::Arg0());
+        return 0;
+    }
+    std::regex filter(CommandArgs::Get<std::string>("--filter", ".*"));
+    const double min_time_s = CommandArgs::Get<double>("--min-time", 0.5);
+    auto save_file = CommandArgs::Get<std::string>("--save", "");
+    if ("" != save_file) save_file = fs::absolute(save_file);
+    const auto baseline_file = CommandArgs::Get<std::string>("--baseline", "");
+    const double max_regression = CommandArgs::Get<double>("--max-regression", -1);
+    std::string baseline_flags;
+    auto baseline = ("" != baseline_file) ? LoadBaseline(baseline_file, &baseline_flags) :
+            std::map<std::string, double>{};
+    if ("" != baseline_file && baseline.empty()) ZTHROW("no results in the baseline file(%s)", baseline_file.data());
+    if ("" != baseline_file && MICROBENCH_FLAGS != baseline_flags) {
+        fprintf(stderr, "[Error]the baseline(%s) is recorded with the build flags '%s', but this binary is "
+                "built with '%s', please record the baseline again\n", baseline_file.data(),
+                baseline_flags.data(), MICROBENCH_FLAGS);
+        return 1;
+    }
+
+    //run in a temporary project dir, so that the build paths are created under it
+    auto tmp_dir = fs::temp_directory_path() / StringPrintf("zmake_microbench.%d", getpid());
+    fs::create_directories(tmp_dir);
+    fs::current_path(tmp_dir);
+    PrepareTree();
+
+    std::ostringstream oss;
+    oss << kFlagsPrefix << MICROBENCH_FLAGS << std::endl;
+    bool regressed = false;
+    printf("* build flags: %s\n", MICROBENCH_FLAGS);
+#if !defined(__OPTIMIZE__) || defined(_GLIBCXX_DEBUG)
+    ColorPrint("* this binary isn't an optimized build, so the results don't reflect the optimizations\n",
+            CT_YELLOW);
+#endif
+    printf("%-28s %12s %14s", "benchmark", "iterations", "ns/op");
+    if (!baseline.empty()) printf(" %14s %9s", "baseline", "change");
+    printf("\n");
+    for (auto& x : MicroBench::GlobalMicroBenches()) {
+        if (!std::regex_search(x.first, filter)) continue;
+        auto res = RunMicroBench(x.second, min_time_s);
+        oss << x.first << " " << StringPrintf("%.2f", res.ns_per_op) << std::endl;
+        printf("%-28s %12zu %14.2f", x.first.data(), res.iterations, res.ns_per_op);
+        auto iter = baseline.find(x.first);
+        if (baseline.end() != iter && iter->second > 0) {
+            double change = (res.ns_per_op - iter->second) * 100 / iter->second;
+            bool is_regression = max_regression >= 0 && change > max_regression;
+            regressed = regressed || is_regression;
+            auto str = StringPrintf(" %14.2f %+8.1f%%", iter->second, change);
+            if (is_regression) ColorPrint(str, CT_BRIGHT_RED);
+            else printf("%s", str.data());
+        }
+        printf("\n");
+    }
+
+    std::error_code ec;
+    fs::remove_all(tmp_dir, ec);
+    if ("" != save_file) {
+        StringToFile(oss.str(), save_file);
+        ColorPrint(StringPrintf("* the results are saved into %s\n", save_file.data()), CT_BRIGHT_GREEN);
+    }
+    return regressed ? 1 : 0;
+}
@@ -6,15 +6,11 @@
  */
 
 #include "zmake_helper.h"
+#include "zmake_internal.h"
 
 using namespace zmake;
 namespace fs = std::filesystem;
 
-namespace zmake {
-    extern std::string GetBuildPath(const std::string& path);
-    extern std::string ExecuteCmd(const std::string& cmd, int* ret_code = nullptr);
-}
-
 int main(int argc, char* argv[]) {
     CommandArgs::Init(argc, argv);
     if (CommandArgs::Has("-h")) {
@@ -71,6 +67,59 @@ int main(int argc, char* argv[]) {
         if (fs::exists(libs_file)) external_prjs.push_back(GetDirnameFromPath(f));
     }
 
+    //the external zmake projects built by BuildExternalZmakeProject("name", "path") in any BUILD.inc,
+    //their building rules are compiled into BUILD.exe under '.zmade/.external/<name>/'
+    std::map<std::string, std::string> built_external_prjs;
+    std::vector<std::string> rule_files = ListFilesUnderDir(fs::current_path(), "^BUILD.(inc|cpp)$", true, true);
+    std::regex ext_reg("BuildExternalZmakeProject\\s*\\(\\s*\"@?([^\"/]+)/?\"\\s*,\\s*\"([^\"]+)\"");
+    for (size_t i = 0; i < rule_files.size(); ++i) {
+        auto str = StringFromFile(rule_files[i]);
+        for (std::sregex_iterator it(str.begin(), str.end(), ext_reg), end; it != end; ++it) {
+            auto name = (*it)[1].str();
+            if (built_external_prjs.count(name)) continue;
+            std::string dir = (*it)[2].str();
+            if ('/' != dir.at(0)) dir = GetDirnameFromPath(rule_files[i]) + dir;
+            dir = fs::path(dir).lexically_normal();
+            if ('/' != *dir.rbegin()) dir += "/";
+            built_external_prjs[name] = dir;
+            external_prjs.push_back(dir);
+            for (auto f : ListFilesUnderDir(dir, "^BUILD.(inc|cpp)$", true)) {
+                auto rel = fs::path(f).lexically_relative(dir).string();
+                if ('.' != rel.at(0) && std::string::npos == rel.find("/.")) rule_files.push_back(f);
+            }
+        }
+    }
+    if (fs::exists(build_root + ".external/")) {
+        for (auto& e : fs::directory_iterator(build_root + ".external/")) {
+            if (!built_external_prjs.count(e.path().filename())) fs::remove_all(e.path());
+        }
+    }
+    for (auto& x : built_external_prjs) {
+        auto ext_build_root = build_root + ".external/" + x.first + "/";
+        bool has_ext_workspace_header = fs::exists(x.second + "WORKSPACE.h");
+        for (auto f : ListFilesUnderDir(x.second, "^BUILD.(inc|cpp)$", true)) {
+            auto rel = fs::path(f).lexically_relative(x.second).string();
+            if ('.' == rel.at(0) || std::string::npos != rel.find("/.")) continue;
+            auto cpp_file = ext_build_root + StringReplaceSuffix(rel, ".inc", ".cpp");
+            fs::create_directories(GetDirnameFromPath(cpp_file));
+            if (StringEndWith(f, ".cpp")) {
+                fs::remove(cpp_file);
+                fs::copy(f, cpp_file, fs::copy_options::create_symlinks);
+                continue;
+            }
+            auto str = StringPrintf(
+"#include \"zmake_helper.h\"\n" \
+"using namespace zmake;\n"      \
+"%s"                            \
+"\n"                            \
+"BUILD() {\n"                   \
+"#include \"%s\"\n"             \
+"}", (has_ext_workspace_header ? ("#include \"" + x.second + "WORKSPACE.h\"\n").data() : ""), f.data());
+            //keep the mtime if nothing changes, so that BUILD.exe won't be relinked
+            if (!fs::exists(cpp_file) || StringFromFile(cpp_file) != str) StringToFile(str, cpp_file);
+        }
+    }
+
     auto is_external_file_fn = [&](const std::string& f) {
         for (auto x : external_prjs) if (StringBeginWith(f, x)) return true;
         return false;
@@ -106,6 +155,10 @@ int main(int argc, char* argv[]) {
         auto obj = AccessObject(f);
         for (auto hdr : Glob({"*.h"}, {}, zmake_include_dir)) obj->AddDep(AccessFile(hdr));
         if (has_workspace_header) obj->AddDep(AccessFile("WORKSPACE.h"));
+        for (auto& x : built_external_prjs) {
+            if (!StringBeginWith(f, build_root + ".external/" + x.first + "/")) continue;
+            if (fs::exists(x.second + "WORKSPACE.h")) obj->AddDep(AccessFile(x.second + "WORKSPACE.h"));
+        }
         exec->AddObj(obj);
     }
     if (exec->GetObjs().empty()) {
@@ -0,0 +1,30 @@
+#!/bin/bash
+#editing a function body in an obj of a thin static lib might keep the size and symbols of the obj,
+#so the archive itself is byte-identical after rearchiving, but the binary linking it must be relinked
+set -e
+ZMAKE=${ZMAKE:-$HOME/bin/zmake}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+mkdir lib app
+echo 'SetArchiveMode(AM_THIN);' > BUILD.inc
+echo 'int Value() { return 1; }' > lib/a.cpp
+echo 'AccessLibrary("a")->AddObjs({"a.cpp"});' > lib/BUILD.inc
+printf '#include <cstdio>\nint Value();\nint main() { printf("%%d\\n", Value()); return 0; }\n' > app/main.cpp
+echo 'AccessBinary("app")->AddObjs({"main.cpp"})->AddLib("/lib/a");' > app/BUILD.inc
+
+"$ZMAKE" -j4 > build.log 2>&1 || { cat build.log; exit 1; }
+[ "$(.zmade/app/app)" = "1" ] || { echo "FAILED: the first build prints '$(.zmade/app/app)'"; exit 1; }
+archive_md5=$(md5sum .zmade/lib/liba.a | cut -d' ' -f1)
+
+echo 'int Value() { return 2; }' > lib/a.cpp
+./BUILD.exe -j4 > rebuild.log 2>&1 || { cat rebuild.log; exit 1; }
+if [ "$(md5sum .zmade/lib/liba.a | cut -d' ' -f1)" != "$archive_md5" ]; then
+    echo "WARN: the thin archive isn't byte-identical after the edit, so this test proves nothing here"
+fi
+[ "$(.zmade/app/app)" = "2" ] || { echo "FAILED: the binary isn't relinked, it prints '$(.zmade/app/app)'"; exit 1; }
+#and the md5 of the archive is stable, so nothing is rebuilt without changes
+rebuilt=$(./BUILD.exe -j4 -d 2>&1 | grep '^> build' || true)
+[ -z "$rebuilt" ] || { echo "FAILED: the no-op build rebuilds: $rebuilt"; exit 1; }
+echo "PASSED: $(basename "$0")"
@@ -1,11 +1,26 @@
 #include <sys/stat.h>
+#include <sys/file.h>
+#if __has_include(<elf.h>)
+#include <elf.h>
+#endif
+#include <fcntl.h>
 #include <signal.h>
+#include <climits>
+#include <cstddef>
+#include <cstring>
 #include <set>
+#include <deque>
+#include <array>
+#include <unordered_set>
 #include <sstream>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include "zmake.h"
+#include "zmake_internal.h"
 
 #include "zmake_util.h"
+#include "zmake_helper.h"
 
 #define BUILD_DIR_NAME ".zmade"
 #define FP(f) f->GetFilePath().data()
@@ -19,8 +34,17 @@ enum GlobalResourceType {
     GRT_FILE = 1,
     GRT_DEFAULT_COMPILER = 2, GRT_DC = 2,
     GRT_MD5 = 3,
+    GRT_FAILED_FILE = 4,
+    GRT_OPAQUE_FILE = 5,
+    GRT_VARIANT = 6,
+    GRT_BUILD_TIME = 7,
+    GRT_EXPLAINED_FILE = 8,
+    GRT_MODULE = 9,
+    GRT_PROTO_IMPORT = 10,
+    GRT_EXTERNAL_PROJECT = 11,
     GRT_RUNNER_BEFORE_BUILD_ALL = 12, GRT_RBB = 12,
     GRT_RUNNER_AFTER_BUILD_ALL = 13, GRT_RAB = 13,
+    GRT_NODE = 14,
 };
 template <typename T, GlobalResourceType>
 struct GlobalResource {
@@ -33,9 +57,216 @@ struct GlobalResource {
         std::call_once(s_flag, [&initializer]() { initializer(Resource()); });
     }
 };
-auto& GlobalFiles() { return GlobalResource<std::map<std::string, ZFile*>, GRT_FILE>::Resource(); }
+std::map<std::string, ZFile*>& GlobalFiles() { return GlobalResource<std::map<std::string, ZFile*>, GRT_FILE>::Resource(); }
 constexpr auto GlobalRBB = GlobalResource<std::vector<std::function<void()>>, GRT_RBB>::Resource;
 constexpr auto GlobalRAB = GlobalResource<std::vector<std::function<void()>>, GRT_RAB>::Resource;
+constexpr auto GlobalFailedFiles = GlobalResource<std::vector<ZFile*>, GRT_FAILED_FILE>::Resource;
+//the deps of these files are only used to build themselves, so they're skipped when collecting libs
+//or include dirs from deps, e.g.: the pgo profile depends on the instrumented binary
+constexpr auto GlobalOpaqueFiles = GlobalResource<std::set<ZFile*>, GRT_OPAQUE_FILE>::Resource;
+//the build states of the nodes, see ZFile::HasState
+enum NodeState : uint8_t {
+    NS_BUILD_DONE = 1,
+    NS_HAS_BEEN_BUILT = 2,
+    NS_FORCED_BUILD = 4,
+    NS_BUILD_FAILED = 8, //its build cmd failed, or any dependency failed in keep-going mode
+    NS_GENERATED_BY_DEP = 16,
+    NS_BATCHED = 32, //its cmd is deferred to run in one batch with others, see ZF::ApplyProtoBatches
+};
+//the elements are allocated page by page and never move, so the building threads can read them while
+//other nodes are being added; it's grown under GlobalGraphMutex
+template <typename T, uint32_t kPageBits>
+struct PagedArray {
+    static constexpr uint32_t kPageSize = 1u << kPageBits;
+    T& operator[](uint32_t i) { return _pages[i >> kPageBits][i & (kPageSize - 1)]; }
+    //make the elements before 'n' available, which are zero-initialized
+    void Grow(uint64_t n) {
+        for (; ((uint64_t)_num_pages << kPageBits) < n; ++_num_pages) {
+            if (_pages.size() == _num_pages) ZTHROW("too many nodes or edges in the build graph");
+            _pages[_num_pages] = new T[kPageSize]();
+        }
+    }
+
+private:
+    std::array<T*, (1u << (32 - kPageBits))> _pages{};
+    uint32_t _num_pages = 0;
+};
+//the hot fields of all nodes of the build graph are kept in the arrays indexed by the node ids instead
+//of the big ZFile objects, so the graph walks and the up-to-date checks only touch a few dense arrays;
+//the deps of node 'i' are 'edges[dep_begins[i]]' to 'edges[dep_begins[i] + dep_sizes[i] - 1]', i.e.: a
+//compressed sparse row adjacency, where each row has some spare capacity and never spans two pages
+struct NodeTable {
+    static constexpr uint32_t kNodePageBits = 14;
+    static constexpr uint32_t kEdgePageBits = 18;
+
+    PagedArray<ZFile*, kNodePageBits> files;
+    PagedArray<FileType, kNodePageBits> types;
+    PagedArray<uint8_t, kNodePageBits> states;
+    PagedArray<long, kNodePageBits> mtimes; //see ZF::GetMTime
+    PagedArray<uint32_t, kNodePageBits> mtime_epochs; //the mtime is stale once it differs from 'mtime_epoch'
+    PagedArray<uint32_t, kNodePageBits> visit_epochs; //the last graph walk visiting it, see ZF::NewVisitEpoch
+    PagedArray<uint32_t, kNodePageBits> dep_begins;
+    PagedArray<uint32_t, kNodePageBits> dep_sizes;
+    PagedArray<uint32_t, kNodePageBits> dep_caps;
+    PagedArray<uint32_t, kEdgePageBits> edges;
+    uint32_t num_nodes = 0;
+    uint64_t edges_end = 0; //the end of the used part of 'edges'
+    std::atomic<uint32_t> mtime_epoch{1};
+
+    uint32_t AddNode(ZFile* f) {
+        auto id = num_nodes++;
+        files.Grow(num_nodes);
+        types.Grow(num_nodes);
+        states.Grow(num_nodes);
+        mtimes.Grow(num_nodes);
+        mtime_epochs.Grow(num_nodes);
+        visit_epochs.Grow(num_nodes);
+        dep_begins.Grow(num_nodes);
+        dep_sizes.Grow(num_nodes);
+        dep_caps.Grow(num_nodes);
+        files[id] = f;
+        return id;
+    }
+    DepRange Deps(uint32_t id) {
+        if (0 == dep_sizes[id]) return {};
+        return {&edges[dep_begins[id]], dep_sizes[id]};
+    }
+    //make room for one more dep of node 'id', the full row is moved to a new one with double capacity,
+    //and the old one is left as it is, so that the DepRange got before is still readable
+    void ReserveDep(uint32_t id) {
+        if (dep_sizes[id] < dep_caps[id]) return;
+        uint32_t cap = std::max(4u, dep_caps[id] * 2);
+        if (cap > edges.kPageSize) ZTHROW("too many deps of '%s'", files[id]->GetFilePath().data());
+        auto page_left = edges.kPageSize - (edges_end & (edges.kPageSize - 1));
+        if (cap > page_left) edges_end += page_left;
+        edges.Grow(edges_end + cap);
+        for (uint32_t i = 0; i < dep_sizes[id]; ++i) edges[edges_end + i] = edges[dep_begins[id] + i];
+        dep_begins[id] = edges_end;
+        dep_caps[id] = cap;
+        edges_end += cap;
+    }
+};
+constexpr auto GlobalNodeTable = GlobalResource<NodeTable, GRT_NODE>::Resource;
+std::mutex& GlobalGraphMutex() {
+    static std::mutex s_mtx;
+    return s_mtx;
+}
+
+//the nodes are never freed, so they're carved out of big chunks by bumping a pointer, which saves
+//the per-allocation overhead of malloc and keeps the nodes created together close in memory
+struct NodeArena {
+    static void* Allocate(size_t size) {
+        constexpr size_t kChunkSize = 4 << 20;
+        constexpr size_t kAlign = alignof(std::max_align_t);
+        static std::mutex s_mtx;
+        static char* s_cur = nullptr;
+        static size_t s_left = 0;
+        size = (size + kAlign - 1) & ~(kAlign - 1);
+        std::lock_guard<std::mutex> guard(s_mtx);
+        if (size > s_left) {
+            s_left = std::max(size, kChunkSize);
+            s_cur = (char*)malloc(s_left);
+            if (!s_cur) throw std::bad_alloc();
+        }
+        auto p = s_cur;
+        s_cur += size;
+        s_left -= size;
+        return p;
+    }
+};
+
+//hands out a dense id and a stable std::string_view for each distinct path, and the interned strings
+//are never moved or freed
+//the lookups are far more than the insertions after the first analysis of each dir, so they share a
+//read-write lock instead of serializing all analysis threads
+struct PathInterner {
+    static uint32_t Intern(std::string_view path) {
+        {
+            std::shared_lock<std::shared_mutex> guard(Mutex());
+            auto iter = Ids().find(path);
+            if (Ids().end() != iter) return iter->second;
+        }
+        std::lock_guard<std::shared_mutex> guard(Mutex());
+        auto iter = Ids().find(path);
+        if (Ids().end() != iter) return iter->second;
+        Paths().emplace_back(path);
+        uint32_t id = Paths().size() - 1;
+        Ids().emplace(Paths().back(), id);
+        return id;
+    }
+    //the interned paths are never moved, so the reference is always valid
+    static const std::string& View(uint32_t id) {
+        std::shared_lock<std::shared_mutex> guard(Mutex());
+        return Paths()[id];
+    }
+    //the absolute and lexically normal form of 'path', which is computed only once for each pair of
+    //the current dir and 'path'
+    static std::string_view Normalize(const std::string& path) {
+        static std::shared_mutex s_mtx;
+        static std::unordered_map<uint64_t, uint32_t> s_normalized;
+        uint64_t cwd_id = (StringBeginWith(path, "/") ? UINT32_MAX : CurrentDir());
+        uint64_t key = cwd_id << 32 | Intern(path);
+        {
+            std::shared_lock<std::shared_mutex> guard(s_mtx);
+            auto iter = s_normalized.find(key);
+            if (s_normalized.end() != iter) return View(iter->second);
+        }
+        auto abs_path = (UINT32_MAX == cwd_id) ? std::filesystem::path(path) :
+                std::filesystem::path(View(cwd_id)) / path;
+        auto id = Intern(abs_path.lexically_normal().native());
+        std::lock_guard<std::shared_mutex> guard(s_mtx);
+        s_normalized[key] = id;
+        return View(id);
+    }
+    //the id of the current dir, which is cached since every resolution of a relative path needs it,
+    //instead of calling getcwd each time; it's updated by ChangeCurrentDir
+    static uint32_t CurrentDir() {
+        auto id = CurrentDirId().load(std::memory_order_acquire);
+        if (UINT32_MAX != id) return id;
+        id = Intern(std::filesystem::current_path().native());
+        CurrentDirId().store(id, std::memory_order_release);
+        return id;
+    }
+    static void ChangeCurrentDir(const std::string& dir) {
+        std::filesystem::current_path(dir);
+        CurrentDirId().store(Intern(std::filesystem::current_path().native()), std::memory_order_release);
+    }
+
+private:
+    static std::deque<std::string>& Paths() {
+        static std::deque<std::string> s_paths;
+        return s_paths;
+    }
+    static std::unordered_map<std::string_view, uint32_t>& Ids() {
+        static std::unordered_map<std::string_view, uint32_t> s_ids;
+        return s_ids;
+    }
+    static std::shared_mutex& Mutex() {
+        static std::shared_mutex s_mtx;
+        return s_mtx;
+    }
+    static std::atomic<uint32_t>& CurrentDirId() {
+        static std::atomic<uint32_t> s_id{UINT32_MAX};
+        return s_id;
+    }
+};
+
+const std::string& GetCurrentDir() {
+    return PathInterner::View(PathInterner::CurrentDir());
+}
+void ChangeCurrentDir(const std::string& dir) {
+    PathInterner::ChangeCurrentDir(dir);
+}
+
+//a compressed sparse row snapshot of the graph reachable from some files, where the nodes are
+//indexed densely in post order(deps first), and the users of 'nodes[i]' are 'users[offsets[i]]'
+//to 'users[offsets[i + 1] - 1]'
+struct GraphSnapshot {
+    std::vector<ZFile*> nodes;
+    std::vector<uint32_t> dep_counts;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> users;
+};
 
 uint32_t* AccessDebugLevel() {
     static uint32_t s_debug_level = 0;
@@ -58,9 +289,35 @@ std::string* AccessDefaultCompiler(const std::string& suffix) {
     return &GlobalResource<T, GRT_DC>::Resource()[suffix];
 }
 
+//the external zmake projects built in-process by BuildExternalZmakeProject: name -> root dirs
+struct ExternalProject {
+    std::string prj_root_dir;
+    std::string build_root_dir;
+};
+constexpr auto GlobalExternalProjects =
+        GlobalResource<std::map<std::string, ExternalProject>, GRT_EXTERNAL_PROJECT>::Resource;
+//the external project that the current thread is working on, "" means the main project; all the
+//files created under it belong to it, and the root dirs are switched to its own ones
+std::string& CurrentExternalProject() {
+    thread_local std::string t_ext_prj;
+    return t_ext_prj;
+}
+struct ExternalProjectGuard {
+    ExternalProjectGuard(const std::string& ext_prj): _old_ext_prj(CurrentExternalProject()) {
+        CurrentExternalProject() = ext_prj;
+    }
+    ~ExternalProjectGuard() { CurrentExternalProject() = _old_ext_prj; }
+
+private:
+    std::string _old_ext_prj;
+};
+
 //TODO no need Access these root dirs
 std::string* AccessProjectRootDir() {
     static std::string s_prj_root_dir = fs::current_path();
+    if ("" != CurrentExternalProject()) {
+        return &GlobalExternalProjects().at(CurrentExternalProject()).prj_root_dir;
+    }
     //TODO init once
     if ('/' != *s_prj_root_dir.rbegin()) s_prj_root_dir += "/";
     return &s_prj_root_dir;
@@ -69,9 +326,19 @@ std::string* AccessProjectRootDir() {
 //TODO change to any other dir and validate it
 std::string* AccessBuildRootDir() {
     static std::string s_build_root_dir = *AccessProjectRootDir() + BUILD_DIR_NAME + "/";
+    if ("" != CurrentExternalProject()) {
+        return &GlobalExternalProjects().at(CurrentExternalProject()).build_root_dir;
+    }
     return &s_build_root_dir;
 }
 
+//the key in GlobalFiles for the project inner path of a lib/binary/obj, which is prefixed by the
+//name of the external project it belongs to, e.g.: "/util/net" -> "@common_utils/util/net"
+std::string GetFileKey(const std::string& inner_path) {
+    if ("" == CurrentExternalProject() || '@' == inner_path.at(0)) return inner_path;
+    return "@" + CurrentExternalProject() + inner_path;
+}
+
 bool* AccessVerboseMode() {
     static bool s_verbose = true;
     return &s_verbose;
@@ -82,8 +349,213 @@ void SetVerboseMode(bool verbose) {
 void SetDebugLevel(uint32_t level) {
     *AccessDebugLevel() = level;
 }
+bool* AccessKeepGoingMode() {
+    static bool s_keep_going = false;
+    return &s_keep_going;
+}
+void SetKeepGoingMode(bool keep_going) {
+    *AccessKeepGoingMode() = keep_going;
+}
+bool* AccessExplainMode() {
+    static bool s_explain = false;
+    return &s_explain;
+}
+void SetExplainMode(bool explain) {
+    *AccessExplainMode() = explain;
+}
+ArchiveMode* AccessArchiveMode() {
+    static ArchiveMode s_archive_mode = AM_INCREMENTAL;
+    return &s_archive_mode;
+}
+void SetArchiveMode(ArchiveMode mode) {
+    *AccessArchiveMode() = mode;
+}
+bool* AccessFastLinkMode() {
+    static bool s_fast_link = false;
+    return &s_fast_link;
+}
+void EnableFastLink(bool enable) {
+    *AccessFastLinkMode() = enable;
+}
+bool ExistsInPath(const std::string& exe) {
+    for (const auto& dir : StringSplit(getenv("PATH") ? getenv("PATH") : "", ':')) {
+        if ("" != dir && fs::exists(dir + "/" + exe)) return true;
+    }
+    return false;
+}
+//return "mold", "lld", "gold" or "" if none of them is found in $PATH
+const std::string& GetFastLinker() {
+    static std::string s_linker = []() -> std::string {
+        for (auto linker : {"mold", "ld.lld", "ld.gold"}) {
+            if (ExistsInPath(linker)) return StringReplaceAll(linker, "ld.", "");
+        }
+        return "";
+    }();
+    return s_linker;
+}
+std::string GetFastLinkCompileFlags() {
+    //'-ggnu-pubnames' provides the names for building '.gdb_index' by the linker
+    return *AccessFastLinkMode() ? " -g -gsplit-dwarf -ggnu-pubnames" : "";
+}
+std::string GetFastLinkLinkFlags() {
+    if (!*AccessFastLinkMode()) return "";
+    const auto& linker = GetFastLinker();
+    //the default linker(GNU ld) doesn't support '--gdb-index'
+    if ("" == linker) return " -g";
+    std::string flags = " -g -fuse-ld=" + linker + " -Wl,--gdb-index";
+    //mold and lld use all cores by default
+    if ("gold" == linker) flags += " -Wl,--threads";
+    return flags;
+}
+LtoMode* AccessLtoMode() {
+    static LtoMode s_lto_mode = LTO_NONE;
+    return &s_lto_mode;
+}
+void EnableLTO(LtoMode mode) {
+    *AccessLtoMode() = mode;
+}
+ZVariant* AccessVariant(const std::string& name) {
+    using T = std::map<std::string, ZVariant>;
+    GlobalResource<T, GRT_VARIANT>::InitOnce([](T& variants) {
+        variants["debug"].SetCompileFlags({"-O0", "-g"})->SetLinkFlags({"-g"});
+        variants["release"].SetCompileFlags({"-O2", "-DNDEBUG"});
+        variants["asan"].SetCompileFlags({"-O1", "-g", "-fsanitize=address", "-fno-omit-frame-pointer"})
+                ->SetLinkFlags({"-fsanitize=address"});
+    });
+    return &GlobalResource<T, GRT_VARIANT>::Resource()[name];
+}
+std::vector<std::string>* AccessBuildVariants() {
+    static std::vector<std::string> s_variants;
+    return &s_variants;
+}
+void SetBuildVariants(const std::vector<std::string>& names) {
+    *AccessBuildVariants() = names;
+}
+bool IsClangCompiler(const std::string& compiler) {
+    return std::string::npos != GetFilenameFromPath(StringSplit(compiler)[0]).find("clang");
+}
+bool* AccessTimeTraceMode() {
+    static bool s_time_trace = false;
+    return &s_time_trace;
+}
+void EnableTimeTrace(bool enable) {
+    *AccessTimeTraceMode() = enable;
+}
+//clang writes the trace next to the obj, e.g.: 'a.o' -> 'a.json'
+std::string GetTimeTraceFile(const std::string& obj_file, const std::string& compiler) {
+    return IsClangCompiler(compiler) ? StringReplaceSuffix(obj_file, ".o", ".json") : obj_file + ".ftr";
+}
+std::string GetLtoCompileFlags(LtoMode mode, const std::string& compiler, bool has_non_lto_user) {
+    if (LTO_NONE == mode) return "";
+    if (IsClangCompiler(compiler)) return LTO_THIN == mode ? " -flto=thin" : " -flto";
+    //the obj is also linked by some non-LTO targets, so the real object code is needed as well
+    return has_non_lto_user ? " -flto -ffat-lto-objects" : " -flto";
+}
+//the parallelism of LTO backend jobs isn't included, it's decided by '-j' when running the cmd
+std::string GetLtoLinkFlags(LtoMode mode, const std::string& compiler, const std::string& cmd) {
+    if (LTO_NONE == mode) return "";
+    if (!IsClangCompiler(compiler) || LTO_FULL == mode) return " -flto";
+    auto cache_dir = *AccessBuildRootDir() + ".lto_cache";
+    std::error_code ec;
+    if (!*AccessExplainMode()) fs::create_directories(cache_dir, ec);
+    if (std::string::npos != cmd.find("-fuse-ld=lld")) {
+        return " -flto=thin -Wl,--thinlto-cache-dir=" + cache_dir;
+    }
+    return " -flto=thin -Wl,-plugin-opt,cache-dir=" + cache_dir;
+}
+
+//the '-j' slots shared by all running jobs; a job with its own parallelism(e.g.: the LTO backend
+//jobs of a link) occupies several slots, so the total load is still constrained by '-j'
+struct JobSlots {
+    static void Init(int total) {
+        RunWithLock(Mutex(), [total]() { Total() = Free() = std::max(total, 1); });
+    }
+    static int GetTotal() { return Total(); }
+    //a waiting job of several slots reserves the freed ones until it has got all of them, otherwise the
+    //jobs of one slot keep taking them, and it(usually a link on the critical path) has to wait until
+    //most of the graph is done; the jobs of several slots wait for the reservation one by one.
+    //return the number of really acquired slots, which should be passed to Release
+    static int Acquire(int n) {
+        std::unique_lock<std::mutex> lock(Mutex());
+        n = std::max(std::min(n, Total()), 1);
+        if (n > 1) {
+            Cv().wait(lock, []() { return !Reserved(); });
+            Reserved() = true;
+            Cv().wait(lock, [n]() { return Free() >= n; });
+            Reserved() = false;
+        } else {
+            Cv().wait(lock, []() { return !Reserved() && Free() >= 1; });
+        }
+        Free() -= n;
+        lock.unlock();
+        if (n > 1) Cv().notify_all();
+        return n;
+    }
+    static void Release(int n) {
+        RunWithLock(Mutex(), [n]() { Free() += n; });
+        Cv().notify_all();
+    }
+
+private:
+    static int& Total() { static int s_total = 1; return s_total; }
+    static int& Free() { static int s_free = 1; return s_free; }
+    static bool& Reserved() { static bool s_reserved = false; return s_reserved; }
+    static std::mutex& Mutex() { static std::mutex s_mtx; return s_mtx; }
+    static std::condition_variable& Cv() { static std::condition_variable s_cv; return s_cv; }
+};
 
-std::string ExecuteCmd(const std::string& cmd, int* ret_code = nullptr) {
+//the number of '-j' slots occupied by an LTO link, i.e.: the parallelism of its backend jobs
+int GetLtoJobWeight(LtoMode mode, const std::string& compiler) {
+    if (LTO_NONE == mode) return 1;
+    //the full LTO of clang runs in one process
+    if (IsClangCompiler(compiler) && LTO_FULL == mode) return 1;
+    return JobSlots::GetTotal();
+}
+
+size_t* AccessResponseFileThreshold() {
+    static size_t s_rsp_threshold = 32768;
+    return &s_rsp_threshold;
+}
+void SetResponseFileThreshold(size_t threshold) {
+    *AccessResponseFileThreshold() = threshold;
+}
+
+//return 'args' directly if the cmd is short enough, otherwise record 'args' as the content of
+//'rsp_file' and return the '@rsp_file' instead; 'args' must start with a space.
+std::string UseResponseFileIfNeeded(const std::string& args, size_t other_len, const std::string& rsp_file,
+        std::vector<std::pair<std::string, std::string>>* rsp_files) {
+    auto threshold = *AccessResponseFileThreshold();
+    if (0 == threshold || args.empty() || other_len + args.size() <= threshold) return args;
+    rsp_files->emplace_back(rsp_file, args.substr(1) + "\n");
+    return " @" + rsp_file;
+}
+void WriteResponseFiles(const std::vector<std::pair<std::string, std::string>>& rsp_files) {
+    for (const auto& x : rsp_files) {
+        if (fs::exists(x.first) && StringFromFile(x.first) == x.second) continue;
+        //one response file might be shared by many objs that are built concurrently
+        auto tmp_file = StringPrintf("%s.%lu.tmp", x.first.data(),
+                std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        fs::create_directories(fs::path(x.first).parent_path());
+        if (!StringToFile(x.second, tmp_file)) ZTHROW("write response file(%s) failed", tmp_file.data());
+        fs::rename(tmp_file, x.first);
+    }
+}
+//the first line of '.cmd' file is the signature of the full cmd including its response files,
+//so the change of cmd can be detected without comparing the whole text of cmd
+std::string GetCommandSignature(const std::string& cmd,
+        const std::vector<std::pair<std::string, std::string>>& rsp_files) {
+    std::string full_cmd = cmd;
+    for (const auto& x : rsp_files) full_cmd += "\n" + x.first + "\n" + x.second;
+    return "# " + StringMd5(full_cmd);
+}
+std::string ReadCommandSignature(const std::string& cmd_file) {
+    std::ifstream f(cmd_file);
+    std::string line;
+    std::getline(f, line);
+    return line;
+}
+
+std::string ExecuteCmd(const std::string& cmd, int* ret_code) {
     std::string result;
     std::array<char, 128> buffer;
     FILE* f = popen(cmd.data(), "r");
@@ -94,14 +566,166 @@ std::string ExecuteCmd(const std::string& cmd, int* ret_code = nullptr) {
     return StringRightTrim(result);
 }
 
+//the duration of the last successful build of each file, which is recorded in 'BUILD.times' and
+//used to estimate the cost of a rebuild in explain mode
+struct BuildTimes {
+    static auto& GetAll() {
+        using T = std::map<std::string, long>;
+        GlobalResource<T, GRT_BUILD_TIME>::InitOnce([](T& file_times) {
+            for (auto& line : StringSplit(StringFromFile(*AccessBuildRootDir() + "BUILD.times"), '\n')) {
+                const auto& infos = StringSplit(line, ' ');
+                if (2 == infos.size()) file_times[infos[0]] = atol(infos[1].data());
+            }
+        });
+        return GlobalResource<T, GRT_BUILD_TIME>::Resource();
+    }
+    //return -1 if it has never been built
+    static long Get(const std::string& file) {
+        auto& file_times = GetAll();
+        long ms = -1;
+        RunWithLock(Mutex(), [&]() { if (file_times.count(file)) ms = file_times[file]; });
+        return ms;
+    }
+    static void Record(const std::string& file, long ms) {
+        auto& file_times = GetAll();
+        RunWithLock(Mutex(), [&]() { file_times[file] = ms; });
+    }
+    static void Save() {
+        std::ostringstream oss;
+        for (auto& x : GetAll()) oss << x.first << " " << x.second << std::endl;
+        StringToFile(oss.str(), *AccessBuildRootDir() + "BUILD.times");
+    }
+
+private:
+    static std::mutex& Mutex() {
+        static std::mutex s_mtx;
+        return s_mtx;
+    }
+};
+
+//the mtime is cached, so use 'refresh' to stat it again after the file is rebuilt
+long AcquireFileMTime(const std::string& path, bool refresh = false);
+
 //wrap all friend functions into this class.
 class ZF {
 public:
-    static void ExecuteBuild(ZFile* f) {
-        auto exec_cmd = StringPrintf("(cd %s; %s)", f->_cwd.data(), f->_cmd.data());
-        auto tm_start = std::chrono::system_clock::now();
+    static void RegisterNode(ZFile* f, FileType ft, uint8_t states) {
+        std::lock_guard<std::mutex> guard(GlobalGraphMutex());
+        auto& t = GlobalNodeTable();
+        f->_id = t.AddNode(f);
+        t.types[f->_id] = ft;
+        t.states[f->_id] = states;
+    }
+    //register 'clone' as a new node with the same type, states and deps as 'origin'
+    static void RegisterClone(ZFile* clone, const ZFile* origin) {
+        std::lock_guard<std::mutex> guard(GlobalGraphMutex());
+        auto& t = GlobalNodeTable();
+        clone->_id = t.AddNode(clone);
+        t.types[clone->_id] = t.types[origin->_id];
+        t.states[clone->_id] = t.states[origin->_id];
+        for (uint32_t i = 0; i < t.dep_sizes[origin->_id]; ++i) {
+            t.ReserveDep(clone->_id);
+            auto dep_id = t.edges[t.dep_begins[origin->_id] + i];
+            t.edges[t.dep_begins[clone->_id] + t.dep_sizes[clone->_id]++] = dep_id;
+        }
+    }
+    static ZFile* GetNode(uint32_t id) { return GlobalNodeTable().files[id]; }
+    static DepRange GetDeps(const ZFile* f) { return GlobalNodeTable().Deps(f->_id); }
+    static void SetFileType(ZFile* f, FileType ft) { GlobalNodeTable().types[f->_id] = ft; }
+    //the mtime of 'f' cached in the node table, which is stale once any file is re-stated by
+    //AcquireFileMTime(path, true); -1 if it doesn't exist
+    static long GetMTime(ZFile* f) {
+        auto& t = GlobalNodeTable();
+        const auto epoch = t.mtime_epoch.load();
+        if (epoch == t.mtime_epochs[f->_id]) return t.mtimes[f->_id];
+        auto mtime = AcquireFileMTime(f->_file);
+        if (mtime < 0) return mtime;
+        t.mtimes[f->_id] = mtime;
+        t.mtime_epochs[f->_id] = epoch;
+        return mtime;
+    }
+    //a graph walk marks the visited nodes by a new epoch instead of collecting them into a set
+    static uint32_t NewVisitEpoch() {
+        static uint32_t s_epoch = 0;
+        return ++s_epoch;
+    }
+    //whether 'to' can be reached from 'from' through deps, it should be called with GlobalGraphMutex
+    static bool Reaches(uint32_t from, uint32_t to) {
+        auto& t = GlobalNodeTable();
+        const auto epoch = NewVisitEpoch();
+        std::vector<uint32_t> stack{from};
+        t.visit_epochs[from] = epoch;
+        while (!stack.empty()) {
+            auto id = stack.back();
+            stack.pop_back();
+            if (id == to) return true;
+            for (auto dep = t.dep_begins[id], end = dep + t.dep_sizes[id]; dep < end; ++dep) {
+                auto dep_id = t.edges[dep];
+                if (epoch == t.visit_epochs[dep_id]) continue;
+                t.visit_epochs[dep_id] = epoch;
+                stack.push_back(dep_id);
+            }
+        }
+        return false;
+    }
+    static GraphSnapshot SnapshotGraph(const std::vector<ZFile*>& files) {
+        std::lock_guard<std::mutex> guard(GlobalGraphMutex());
+        auto& t = GlobalNodeTable();
+        GraphSnapshot g;
+        std::vector<uint32_t> index_of(t.num_nodes, UINT32_MAX);
+        const auto epoch = NewVisitEpoch();
+        //(node id, the next dep to visit)
+        std::vector<std::pair<uint32_t, uint32_t>> stack;
+        for (auto f : files) {
+            if (epoch == t.visit_epochs[f->_id]) continue;
+            t.visit_epochs[f->_id] = epoch;
+            stack.emplace_back(f->_id, 0);
+            while (!stack.empty()) {
+                auto& top = stack.back();
+                if (top.second < t.dep_sizes[top.first]) {
+                    auto dep_id = t.edges[t.dep_begins[top.first] + top.second++];
+                    if (epoch != t.visit_epochs[dep_id]) {
+                        t.visit_epochs[dep_id] = epoch;
+                        stack.emplace_back(dep_id, 0);
+                    }
+                    continue;
+                }
+                index_of[top.first] = g.nodes.size();
+                g.nodes.push_back(t.files[top.first]);
+                stack.pop_back();
+            }
+        }
+        //the users of each node are the reversed deps, which are laid out in the same way as the deps
+        g.dep_counts.resize(g.nodes.size());
+        g.offsets.assign(g.nodes.size() + 1, 0);
+        for (size_t i = 0; i < g.nodes.size(); ++i) {
+            auto id = g.nodes[i]->_id;
+            g.dep_counts[i] = t.dep_sizes[id];
+            for (uint32_t k = 0; k < t.dep_sizes[id]; ++k) {
+                ++g.offsets[index_of[t.edges[t.dep_begins[id] + k]] + 1];
+            }
+        }
+        for (size_t i = 0; i < g.nodes.size(); ++i) g.offsets[i + 1] += g.offsets[i];
+        g.users.resize(g.offsets.back());
+        auto fill_pos = g.offsets;
+        for (size_t i = 0; i < g.nodes.size(); ++i) {
+            auto id = g.nodes[i]->_id;
+            for (uint32_t k = 0; k < t.dep_sizes[id]; ++k) {
+                g.users[fill_pos[index_of[t.edges[t.dep_begins[id] + k]]]++] = i;
+            }
+        }
+        return g;
+    }
+    //return false if the build cmd failed in keep-going mode, otherwise exit directly once it failed
+    static bool ExecuteBuild(ZFile* f) {
+        auto exec_cmd = StringPrintf("(cd %s; %s)", f->_cwd.data(),
+                ("" != f->_exec_cmd ? f->_exec_cmd : f->_cmd).data());
         int ret_code = 0;
+        auto slots = JobSlots::Acquire(f->_job_weight);
+        //the time waiting for slots isn't part of the build time
+        auto tm_start = std::chrono::system_clock::now();
         (void)ExecuteCmd(exec_cmd, &ret_code);
+        JobSlots::Release(slots);
         auto spend_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
                 std::chrono::system_clock::now() - tm_start).count();
         {
@@ -112,14 +736,78 @@ public:
                     f->_file.data(), spend_ms), CT_BRIGHT_YELLOW);
             if (*AccessVerboseMode()) printf("# %s\n", exec_cmd.data());
         }
+        if (0 == ret_code) BuildTimes::Record(f->_file, spend_ms);
         if (0 != ret_code) {
-            kill(0, SIGKILL);
-            _exit(2);
+            if (!*AccessKeepGoingMode()) {
+                kill(0, SIGKILL);
+                _exit(2);
+            }
+            //never leave a partial output, and the '.proto' file is the input of ZProto
+            std::error_code ec;
+            if (FT_PROTO_FILE != f->GetFileType()) fs::remove(f->_file, ec);
+            for (const auto& gen_file : f->_gen_files) fs::remove(gen_file, ec);
+            MarkBuildFailed(f);
         }
+        return 0 == ret_code;
     }
-    static void UpdateGeneratedByDep(ZFile* f, bool val) { f->_generated_by_dep = val; }
+    static void MarkBuildFailed(ZFile* f) {
+        static std::mutex s_mtx;
+        f->SetState(NS_BUILD_FAILED);
+        RunWithLock(s_mtx, [f]() { GlobalFailedFiles().push_back(f); });
+    }
+    //protoc generates files into the staging dir of 'f' instead of the build root dir, and only the
+    //changed ones are moved to the build root dir by CommitStagedFiles
+    static std::string GetStagingDir(ZFile* f);
+    static std::string ComposeStagedExecCommand(ZFile* f);
+    static void CommitStagedFiles(ZFile* f);
+    static void UpdateGeneratedByDep(ZFile* f, bool val) { f->SetState(NS_GENERATED_BY_DEP, val); }
     static void UpdateCwd(ZFile* f, const std::string& val) { f->_cwd = val; }
     static void AddObjectUser(ZObject* obj, ZFile* user) { obj->AddObjectUser(user); }
+    //record the file which would be rebuilt in explain mode, instead of building it
+    static void ExplainBuild(ZFile* f, const std::string& reason, const std::string& origin);
+    //the changed input that originally triggers the rebuild of 'f' in explain mode
+    static std::string GetBuildOrigin(ZFile* f);
+    static int GetJobWeight(ZFile* f);
+    static void PrintExplanation();
+    //aggregate the self-profile results of all objs that 'files' depend on
+    static void ReportTimeTrace(const std::vector<ZFile*>& files);
+    //scan the module declarations and imports of all objs, then make them depend on the CMI files of
+    //the modules and header units they import
+    static void ApplyModules();
+    //before the first compile, i.e.: there is no '.d' file, scan the '#include' directives of the objs
+    //of 'files' to make them depend on the headers they really include, especially the generated ones
+    static void ScanIncludes(const std::vector<ZFile*>& files);
+    //regenerate all the out-of-date protos of 'files' by a few protoc invocations, where protos sharing
+    //the same compiler and import dirs are batched into chunks, each of which is one multi-output node
+    static void ApplyProtoBatches(const std::vector<ZFile*>& files);
+    //parse the imports of all protos to make them depend on the imported protos, and make the '.pb.h'
+    //and the '.pb.cc' obj of each proto depend on the '.pb.h'(or '.pb.cc') of the imported protos
+    static void ApplyProtoImports();
+    static void ApplyLTO();
+    static void ApplyPGO();
+    static void ApplyLayoutOptimization();
+    //process all the objs linked into the binary or shared lib 'f', including the ones inside static libs
+    static void ProcessLinkedObjects(ZFile* f, const std::function<void(ZObject*)>& fn);
+    //clone 'f' into the variant dir '.zmade/.variants/<variant>/', and all the objs and internal static
+    //libs(and internal shared libs if 'clone_shared_libs' is true) it depends on are cloned recursively,
+    //while other deps(e.g.: headers and imported libs) are shared; 'clones' records the mapping from
+    //original files to the cloned ones.
+    static ZFile* CloneForVariant(ZFile* f, const std::string& variant, std::map<ZFile*, ZFile*>* clones,
+            bool clone_shared_libs = false);
+    //replace the deps of 'f' by their clones in place
+    static void RemapVariantDeps(ZFile* f, const std::string& variant, std::map<ZFile*, ZFile*>* clones,
+            bool clone_shared_libs = false);
+    //replace 'targets' by their clones of all the variants set by SetBuildVariants
+    static void ApplyVariants(std::vector<ZFile*>* targets);
+    template <typename T>
+    static T* Duplicate(T* f, const std::string& file) {
+        auto clone = new T(*f);
+        RegisterClone(clone, f);
+        clone->_file = file;
+        if (f->_conf) clone->_conf = new ZConfig(*f->_conf);
+        if (f->_generator) clone->_generator = new ZGenerator(*f->_generator);
+        return clone;
+    }
     template <typename T, typename... Args>
     static T* Create(Args... args) { return new T(args...); }
 };
@@ -210,8 +898,8 @@ ZConfig* DefaultObjectConfig() {
 }
 ZConfig* DefaultStaticLibraryConfig() {
     static ZConfig s_static_lib_conf;
-    if (!s_static_lib_conf.HasFlag("crs")) {
-        s_static_lib_conf.SetFlag("crs");
+    if (!s_static_lib_conf.HasFlag("crsD")) {
+        s_static_lib_conf.SetFlag("crsD");
     }
     return &s_static_lib_conf;
 }
@@ -231,36 +919,76 @@ ZConfig* DefaultBinaryConfig() {
 //  p(lib_name): curl/net
 //  project inner path: /core/curl/net
 //  build path: /workspace/${BUILD_DIR_NAME}/core/curl/libnet.a
+//the path resolution only depends on the input path, the project root, the build root and the current
+//dir(only for a relative input path), so its results are memoized by the interned ids of these paths
+struct PathResolver {
+    std::string Resolve(const std::string& path, const std::function<std::string()>& resolve_fn) {
+        Key key = {PathInterner::Intern(path), PathInterner::Intern(*AccessProjectRootDir()),
+                PathInterner::Intern(*AccessBuildRootDir()), StringBeginWith(path, "/") ?
+                UINT32_MAX : PathInterner::CurrentDir()};
+        {
+            std::shared_lock<std::shared_mutex> guard(_mtx);
+            auto iter = _results.find(key);
+            if (_results.end() != iter) return PathInterner::View(iter->second);
+        }
+        auto result = resolve_fn();
+        auto id = PathInterner::Intern(result);
+        std::lock_guard<std::shared_mutex> guard(_mtx);
+        _results[key] = id;
+        return result;
+    }
+    //create the dir if it's the first time to see it, instead of checking its existence every time
+    static void CreateDirOnce(const std::string& dir) {
+        static std::mutex s_mtx;
+        static std::unordered_set<uint32_t> s_created_dirs;
+        auto id = PathInterner::Intern(dir);
+        std::lock_guard<std::mutex> guard(s_mtx);
+        if (!s_created_dirs.insert(id).second || *AccessExplainMode()) return;
+        if (!fs::exists(dir)) fs::create_directories(dir);
+    }
+
+private:
+    using Key = std::array<uint32_t, 4>;
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return (((uint64_t)k[0] << 32 | k[1]) * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)k[2] << 32 | k[3]);
+        }
+    };
+    std::shared_mutex _mtx;
+    std::unordered_map<Key, uint32_t, KeyHash> _results;
+};
+
 std::string ConvertToProjectInnerPath(const std::string& p) {
     if ('/' == p.at(0) || '@' == p.at(0)) return p;
-    std::string result =
-            fs::absolute(p).lexically_relative(*AccessProjectRootDir()).lexically_normal();
+    static PathResolver s_resolver;
+    return s_resolver.Resolve(p, [&p]() {
+        std::string result =
+                fs::absolute(p).lexically_relative(*AccessProjectRootDir()).lexically_normal();
 #ifdef __MACH__
-    result = fs::path(result).lexically_relative(fs::current_path());
+        result = fs::path(result).lexically_relative(GetCurrentDir());
 #endif
-    if ('/' != result.at(0)) result = "/" + result;
-    return result;
+        if ('/' != result.at(0)) result = "/" + result;
+        return result;
+    });
 }
 std::string GetBuildPath(const std::string& path) {
     if ("" == path) return path;
-    fs::path build_path = path;
-    if ('/' != path.at(0) || !StringBeginWith(path, *AccessBuildRootDir())) {
-        const std::string prj_inner_path = ConvertToProjectInnerPath(path);
-        if (StringBeginWith(prj_inner_path, *AccessProjectRootDir())) {
-            build_path = *AccessBuildRootDir() +
-                    prj_inner_path.substr(AccessProjectRootDir()->size());
-        } else {
-            build_path = *AccessBuildRootDir() + prj_inner_path.substr(1);
+    static PathResolver s_resolver;
+    return s_resolver.Resolve(path, [&path]() {
+        fs::path build_path = path;
+        if ('/' != path.at(0) || !StringBeginWith(path, *AccessBuildRootDir())) {
+            const std::string prj_inner_path = ConvertToProjectInnerPath(path);
+            if (StringBeginWith(prj_inner_path, *AccessProjectRootDir())) {
+                build_path = *AccessBuildRootDir() +
+                        prj_inner_path.substr(AccessProjectRootDir()->size());
+            } else {
+                build_path = *AccessBuildRootDir() + prj_inner_path.substr(1);
+            }
         }
-    }
-    build_path = build_path.lexically_normal();
-
-    auto build_dir = build_path.parent_path();
-    if (!fs::exists(build_dir)) {
-        fs::create_directories(build_dir);
-    }
-
-    return build_path;
+        build_path = build_path.lexically_normal();
+        PathResolver::CreateDirOnce(build_path.parent_path());
+        return build_path.string();
+    });
 }
 
 std::string GetBuildRootPath(const std::string& path) {
@@ -273,20 +1001,26 @@ std::string GetBuildRootPath(const std::string& path) {
     return path;
 }
 
-ZFile*& AccessFileInternal(const std::string& file, bool create_file = false,
-        bool need_build = false, FileType ft = FT_NONE) {
+//the obj of a module interface unit keeps its suffix, so that "a.cppm" and "a.cpp" can be in one dir
+std::string ReplaceSourceSuffix(const std::string& src, const std::string& new_suffix) {
+    if (StringEndWith(src, CPP_MODULE_SUFFIXES)) return src + new_suffix;
+    return StringReplaceSuffix(src, C_CPP_SOURCE_SUFFIXES, new_suffix);
+}
+
+ZFile*& AccessFileInternal(const std::string& file, bool create_file, bool need_build, FileType ft) {
     std::string p = file;
     if (FT_SOURCE_FILE == ft || StringEndWith(file, C_CPP_SOURCE_SUFFIXES)) {
         if (FT_NONE == ft) ft = FT_SOURCE_FILE;
-        p = fs::absolute(file).lexically_normal();
+        p = PathInterner::Normalize(file);
     } else if (FT_HEADER_FILE == ft || StringEndWith(file, C_CPP_HEADER_SUFFIXES)) {
         if (FT_NONE == ft) ft = FT_HEADER_FILE;
-        p = fs::absolute(file).lexically_normal();
+        p = PathInterner::Normalize(file);
     } if (FT_PROTO_FILE == ft || StringEndWith(file, ".proto")) {
         if (FT_NONE == ft) ft = FT_PROTO_FILE;
-        p = fs::absolute(file).lexically_normal();
+        p = PathInterner::Normalize(file);
     } else {
         p = ConvertToProjectInnerPath(p);
+        if (FT_SOURCE_FILE != ft && FT_HEADER_FILE != ft) p = GetFileKey(p);
     }
 
     auto*& result = GlobalFiles()[p];
@@ -375,13 +1109,15 @@ void RegisterDefaultGenerator(const std::string& suffix, const ZGenerator& g) {
     }
 }
 
-long AcquireFileMTime(const std::string& path) {
+long AcquireFileMTime(const std::string& path, bool refresh) {
     static std::unordered_map<std::string, long> s_file_stats;
     static std::mutex s_mtx;
 
+    //the mtimes cached by the nodes might be of the refreshed file
+    if (refresh) ++GlobalNodeTable().mtime_epoch;
     long mtime = 0;
-    RunWithLock(s_mtx, [&mtime, &path]() {
-        if (s_file_stats.count(path)) mtime = s_file_stats[path];
+    RunWithLock(s_mtx, [&mtime, &path, refresh]() {
+        if (!refresh && s_file_stats.count(path)) mtime = s_file_stats[path];
     });
     if (0 == mtime) {
         struct stat result;
@@ -396,42 +1132,57 @@ long AcquireFileMTime(const std::string& path) {
     return mtime;
 }
 
-std::string FormalizeLibraryName(const std::string& lib_name, bool is_imported_lib = false) {
-    std::string name = lib_name;
-    if (is_imported_lib && '@' != name.at(0)) name = "@" + name;
-    if (':' == name.at(0)) name = name.substr(1);
-    std::string filename = GetFilenameFromPath(name);
-    auto p = filename.rfind(':');
-    if (std::string::npos != p) {
-        filename[p] = '/';
-        if (std::string::npos != filename.find(':')) {
-            ZTHROW("the filename part of lib_name(%s) should only have one ':' at most",
-                    lib_name.data());
+std::string FormalizeLibraryName(const std::string& lib_name, bool is_imported_lib) {
+    static PathResolver s_resolvers[2];
+    return s_resolvers[is_imported_lib].Resolve(lib_name, [&]() {
+        std::string name = lib_name;
+        if (is_imported_lib && '@' != name.at(0)) name = "@" + name;
+        if (':' == name.at(0)) name = name.substr(1);
+        std::string filename = GetFilenameFromPath(name);
+        auto p = filename.rfind(':');
+        if (std::string::npos != p) {
+            filename[p] = '/';
+            if (std::string::npos != filename.find(':')) {
+                ZTHROW("the filename part of lib_name(%s) should only have one ':' at most",
+                        lib_name.data());
+            }
+            name = GetDirnameFromPath(name) + filename;
         }
-        name = GetDirnameFromPath(name) + filename;
-    }
-    name = ConvertToProjectInnerPath(name);
-    if ('@' == name.at(0) && std::string::npos == name.find('/')) name += "/";
-    return fs::path(name).lexically_normal();
+        name = ConvertToProjectInnerPath(name);
+        if ('@' == name.at(0) && std::string::npos == name.find('/')) name += "/";
+        return fs::path(name).lexically_normal().string();
+    });
 }
 
-void ProcessDepsRecursively(const std::vector<ZFile*>& deps, const std::function<void(ZFile*)>& fn,
-        std::set<ZFile*>* uniq_deps = nullptr) {
-    auto valid_uniq_deps = uniq_deps ? uniq_deps : new std::set<ZFile*>();
-    for (auto iter = deps.rbegin(); deps.rend() != iter; ++iter) {
-        if (!valid_uniq_deps->insert(*iter).second) continue;
-        ProcessDepsRecursively((*iter)->GetDeps(), fn, valid_uniq_deps);
-        fn(*iter);
+template <typename Files>
+void ProcessDepsRecursivelyImpl(const Files& deps, const std::function<void(ZFile*)>& fn,
+        std::set<ZFile*>* uniq_deps) {
+    for (size_t i = deps.size(); i > 0; --i) {
+        auto dep = deps[i - 1];
+        if (!uniq_deps->insert(dep).second) continue;
+        ProcessDepsRecursivelyImpl(dep->GetDeps(), fn, uniq_deps);
+        fn(dep);
     }
-    if (!uniq_deps) delete valid_uniq_deps;
+}
+void ProcessDepsRecursively(const std::vector<ZFile*>& deps, const std::function<void(ZFile*)>& fn,
+        std::set<ZFile*>* uniq_deps) {
+    std::set<ZFile*> local_uniq_deps;
+    ProcessDepsRecursivelyImpl(deps, fn, uniq_deps ? uniq_deps : &local_uniq_deps);
+}
+void ProcessDepsRecursively(const DepRange& deps, const std::function<void(ZFile*)>& fn,
+        std::set<ZFile*>* uniq_deps) {
+    std::set<ZFile*> local_uniq_deps;
+    ProcessDepsRecursivelyImpl(deps, fn, uniq_deps ? uniq_deps : &local_uniq_deps);
 }
 
-void UpdateOptimizationLevel(std::string& cmd, size_t pos = 0, bool del_other_opts = false) {
-    if (!CommandArgs::Has("-O") || pos >= cmd.size()) return;
-    auto o_level = StringPrintf(" -O%d", CommandArgs::Get<int>("-O", 0));
+//replace the first '-O' flag in 'cmd' by 'o_level'(e.g.: " -O2") and remove the other ones; if
+//there is no '-O' flag, 'o_level' is appended when 'append_if_absent' is true
+void ReplaceOptimizationLevel(std::string& cmd, const std::string& o_level, bool append_if_absent,
+        size_t pos = 0, bool del_other_opts = false) {
+    if (pos >= cmd.size()) return;
     auto p = cmd.find(" -O", pos);
     if (std::string::npos == p) {
-        if (0 != CommandArgs::Get<int>("-O", 0) && !del_other_opts) cmd.append(o_level);
+        if (append_if_absent && !del_other_opts) cmd.append(o_level);
     } else {
         auto p_end = cmd.find(" ", p + 3);
         //it's compatible with std::string::npos == p_end
@@ -442,20 +1193,39 @@ void UpdateOptimizationLevel(std::string& cmd, size_t pos = 0, bool del_other_op
             if (!del_other_opts) del_other_opts = true;
         }
         //process other duplicated -O flags
-        UpdateOptimizationLevel(cmd, p + 3, del_other_opts);
+        ReplaceOptimizationLevel(cmd, o_level, append_if_absent, p + 3, del_other_opts);
     }
 }
+void UpdateOptimizationLevel(std::string& cmd) {
+    if (!CommandArgs::Has("-O")) return;
+    auto level = CommandArgs::Get<int>("-O", 0);
+    ReplaceOptimizationLevel(cmd, StringPrintf(" -O%d", level), 0 != level);
+}
+//append the flags of a build variant to 'cmd', and its '-O' flag replaces the original one
+void ApplyVariantFlags(std::string& cmd, const ZConfig& conf) {
+    std::string o_level, flags;
+    for (const auto& flag : StringSplit(conf.ToString())) {
+        if (StringBeginWith(flag, "-O")) o_level = " " + flag;
+        else flags += " " + flag;
+    }
+    if ("" != o_level) ReplaceOptimizationLevel(cmd, o_level, true);
+    cmd += flags;
+}
 
 ZFile::ZFile(const std::string& path, FileType ft, bool need_build):
-        _file(path), _ft(ft), _build_done(!need_build) {
+        _file(path), _ext_prj(CurrentExternalProject()) {
     if (need_build) _file = GetBuildPath(path);
-    _cwd = fs::current_path();
+    _cwd = GetCurrentDir();
     _compiler = *AccessDefaultCompiler(fs::path(_file).extension());
+    ZF::RegisterNode(this, ft, need_build ? 0 : NS_BUILD_DONE);
 }
 ZFile::~ZFile() {
     if (_conf) delete _conf;
     if (_generator) delete _generator;
 }
+void* ZFile::operator new(size_t size) {
+    return NodeArena::Allocate(size);
+}
 
 ZFile* ZFile::SetGenerator(const ZGenerator& g) {
     if (!_generator) _generator = new ZGenerator();
@@ -488,25 +1258,34 @@ ZFile* ZFile::SetFlags(const std::vector<std::string>& flags) {
 }
 
 ZFile* ZFile::AddDep(ZFile* dep) {
-    if (_uniq_deps.insert(dep->GetFilePath()).second) {
-        _deps.push_back(dep);
-        ProcessDepsRecursively(_deps, [&](ZFile* dep) {
-            if (dep == this) ZTHROW("Detected circular dependency for '%s'", _file.data());
-        });
-        //libs should be built before objs, considering following scenario:
-        //  AccessLibrary("cc_base_proto")->AddProto("base.proto");
-        //  AccessLibrary("cc_ps_proto")
-        //    ->AddProto("ps.proto")
-        //    ->AddDep("cc_base_proto");
-        //
-        //for libcc_ps_proto.a, libcc_base_proto.a should be compiled first, because
-        //compiling ps.pb.cc needs base.pb.h;
-        if (FT_OBJ_FILE != dep->GetFileType() && _deps.size() > 1) {
-            for (int i = _deps.size() - 2; i >= -1; --i) {
-                if (i >= 0 && FT_OBJ_FILE == _deps[i]->GetFileType()) continue;
-                std::swap(_deps[i + 1], _deps.back());
-                break;
-            }
+    std::lock_guard<std::mutex> guard(GlobalGraphMutex());
+    auto& t = GlobalNodeTable();
+    //most nodes have a few deps, and even an obj has hundreds of headers at most, so scanning the
+    //row is cheaper than looking up a set of all the edges
+    const auto begin = t.dep_begins[_id];
+    auto size = t.dep_sizes[_id];
+    for (uint32_t i = 0; i < size; ++i) {
+        if (t.edges[begin + i] == dep->_id) return this;
+    }
+    //only the new dep can close a cycle, so there is no need to walk through the other deps
+    if (ZF::Reaches(dep->_id, _id)) ZTHROW("Detected circular dependency for '%s'", _file.data());
+    t.ReserveDep(_id);
+    auto row = &t.edges[t.dep_begins[_id]];
+    row[size++] = dep->_id;
+    t.dep_sizes[_id] = size;
+    //libs should be built before objs, considering following scenario:
+    //  AccessLibrary("cc_base_proto")->AddProto("base.proto");
+    //  AccessLibrary("cc_ps_proto")
+    //    ->AddProto("ps.proto")
+    //    ->AddDep("cc_base_proto");
+    //
+    //for libcc_ps_proto.a, libcc_base_proto.a should be compiled first, because
+    //compiling ps.pb.cc needs base.pb.h;
+    if (FT_OBJ_FILE != t.types[dep->_id] && size > 1) {
+        for (int i = size - 2; i >= -1; --i) {
+            if (i >= 0 && FT_OBJ_FILE == t.types[row[i]]) continue;
+            std::swap(row[i + 1], row[size - 1]);
+            break;
         }
     }
     return this;
@@ -543,12 +1322,13 @@ ZFile* ZFile::AddDepLibs(const std::vector<std::string>& dep_libs) {
         auto process_fn = [this](const std::string& dep_name, bool is_glob_match) {
             bool find_libs = false;
             auto& files = GlobalFiles();
-            for (auto iter = files.lower_bound(dep_name); files.end() != iter; ++iter) {
-                if (!StringBeginWith(iter->first, is_glob_match ? dep_name : dep_name + "/")) break;
+            const auto dep_key = GetFileKey(dep_name);
+            for (auto iter = files.lower_bound(dep_key); files.end() != iter; ++iter) {
+                if (!StringBeginWith(iter->first, is_glob_match ? dep_key : dep_key + "/")) break;
                 if (iter->second && FT_LIB_FILE == iter->second->GetFileType()) {
                     AddDep(iter->second);
                     find_libs = true;
-                    if (!is_glob_match && iter->first == dep_name) break;
+                    if (!is_glob_match && iter->first == dep_key) break;
                 }
             }
             if (!find_libs) {
@@ -570,8 +1350,19 @@ ZFile* ZFile::AddDepLibs(const std::vector<std::string>& dep_libs) {
     }
     return this;
 }
-const std::vector<ZFile*>& ZFile::GetDeps() const {
-    return _deps;
+DepRange ZFile::GetDeps() const {
+    return ZF::GetDeps(this);
+}
+ZFile* DepRange::Iterator::operator*() const {
+    return ZF::GetNode(*_p);
+}
+
+bool ZFile::HasState(uint8_t state) const {
+    return GlobalNodeTable().states[_id] & state;
+}
+void ZFile::SetState(uint8_t state, bool val) {
+    auto& states = GlobalNodeTable().states[_id];
+    states = val ? (states | state) : (states & ~state);
 }
 
 void ZFile::DumpDepsRecursively(std::string* dump_sinker) const {
@@ -610,18 +1401,18 @@ std::string ZFile::GetFullCommand(bool print_pretty) {
     return _cmd;
 }
 
-std::string ZFile::GetFilePath() const {
+const std::string& ZFile::GetFilePath() const {
     return _file;
 }
 FileType ZFile::GetFileType() const {
-    return _ft;
+    return GlobalNodeTable().types[_id];
 }
-std::string ZFile::GetCwd() const {
+const std::string& ZFile::GetCwd() const {
     return _cwd;
 }
 
 bool ZFile::ComposeCommand() {
-    if ("" == _cmd && !_generated_by_dep) {
+    if ("" == _cmd && !HasState(NS_GENERATED_BY_DEP)) {
         if (_generator) {
             _cmd = _generator->Generate({_file});
         } else {
@@ -630,23 +1421,25 @@ bool ZFile::ComposeCommand() {
             if (g) {
                 _cmd = g->Generate({_file});
             } else if (StringEndWith(_file, C_CPP_HEADER_SUFFIXES)) {
-                _ft = FT_HEADER_FILE;
-                _build_done = true;
+                ZF::SetFileType(this, FT_HEADER_FILE);
+                SetState(NS_BUILD_DONE);
                 return false;
             } else {
                 fprintf(stderr, "[Warn]no need to build this file(%s)\n", _file.data());
-                _build_done = true;
+                SetState(NS_BUILD_DONE);
                 return false;
             }
         }
     }
-    return "" != _cmd || _generated_by_dep;
+    return "" != _cmd || HasState(NS_GENERATED_BY_DEP);
 }
 
 void ZFile::BeTarget() {
     AddTarget(this);
 }
 
+//the md5s recorded in 'BUILD.md5s' are the source of truth to decide whether a file really changed
+//since last build, no matter whether it's a source file or an output rebuilt in this round.
 struct Md5Cache {
     static auto& GetAll() {
         using T = std::map<std::string, std::string>;
@@ -656,6 +1449,7 @@ struct Md5Cache {
                 const auto& infos = StringSplit(line, ' ');
                 if (2 == infos.size()) file_md5s[infos[0]] = infos[1];
             }
+            GetLastBuild() = file_md5s;
         });
         return GlobalResource<T, GRT_MD5>::Resource();
     }
@@ -663,93 +1457,380 @@ struct Md5Cache {
     static std::string Get(const std::string& file, bool check_change = true) {
         auto& file_md5s = GetAll();
         std::string old_md5;
-        static std::mutex s_mtx;
-        RunWithLock(s_mtx, [&]() { if (file_md5s.count(file)) old_md5 = file_md5s[file]; });
+        RunWithLock(Mutex(), [&]() { if (file_md5s.count(file)) old_md5 = file_md5s[file]; });
         //start with '@': checked md5 already, and it changed
         //start with '*': checked md5 already, and it has no change
         if ("" != old_md5 && (!check_change || ('@' == old_md5.at(0) || '*' == old_md5.at(0)))) {
             return old_md5;
         }
 
-        auto new_md5 = ExecuteCmd(StringPrintf("md5sum %s | awk '{print $1}'", file.data()));
+        auto new_md5 = ContentMd5(file);
         new_md5 = (new_md5 != old_md5 ? "@" : "*") + new_md5;
-        RunWithLock(s_mtx, [&]() { file_md5s[file] = new_md5; });
+        RunWithLock(Mutex(), [&]() { file_md5s[file] = new_md5; });
         return new_md5;
     }
+
+    //recalculate the md5 after the file is rebuilt, and return whether its content is different
+    //from the one recorded by last build
+    static bool Update(const std::string& file) {
+        auto& file_md5s = GetAll();
+        auto new_md5 = ContentMd5(file);
+        bool changed = true;
+        RunWithLock(Mutex(), [&]() {
+            auto iter = GetLastBuild().find(file);
+            changed = (GetLastBuild().end() == iter || iter->second != new_md5);
+            file_md5s[file] = (changed ? "@" : "*") + new_md5;
+        });
+        return changed;
+    }
+    //a thin archive only records the names, sizes and symbols of its members, so it might be
+    //byte-identical after a member changes; its md5 covers the md5s of 'members' as well
+    static void SetMembers(const std::string& file, const std::vector<std::string>& members) {
+        RunWithLock(Mutex(), [&]() { GetMembers()[file] = members; });
+    }
+
+private:
+    static std::string ContentMd5(const std::string& file) {
+        std::vector<std::string> members;
+        RunWithLock(Mutex(), [&]() {
+            auto iter = GetMembers().find(file);
+            if (GetMembers().end() != iter) members = iter->second;
+        });
+        auto md5 = FileMd5(file);
+        if (members.empty()) return md5;
+        for (const auto& member : members) md5 += FileMd5(member);
+        return StringMd5(md5);
+    }
+    static std::map<std::string, std::vector<std::string>>& GetMembers() {
+        static std::map<std::string, std::vector<std::string>> s_members;
+        return s_members;
+    }
+    static std::map<std::string, std::string>& GetLastBuild() {
+        static std::map<std::string, std::string> s_last_build_md5s;
+        return s_last_build_md5s;
+    }
+    static std::mutex& Mutex() {
+        static std::mutex s_mtx;
+        return s_mtx;
+    }
 };
 
+//move the staged file to 'file' only if their contents are different, so that an unchanged 'file'
+//keeps its mtime; return whether 'file' is changed
+bool CommitStagedFile(const std::string& staged_file, const std::string& file) {
+    std::error_code ec;
+    if (fs::exists(file) && FileMd5(staged_file) == FileMd5(file)) {
+        fs::remove(staged_file, ec);
+        return false;
+    }
+    fs::rename(staged_file, file);
+    return true;
+}
+
+std::string ZF::GetStagingDir(ZFile* f) {
+    return GetBuildPath(f->_file) + ".staging/";
+}
+std::string ZF::ComposeStagedExecCommand(ZFile* f) {
+    const auto cpp_out = " --cpp_out=" + *AccessBuildRootDir();
+    auto p = f->_cmd.find(cpp_out + " ");
+    if (std::string::npos == p) return f->_cmd;
+    auto staging_dir = GetStagingDir(f);
+    return StringPrintf("rm -rf %s && mkdir -p %s && ", staging_dir.data(), staging_dir.data()) +
+            std::string(f->_cmd).replace(p, cpp_out.size(), " --cpp_out=" + staging_dir);
+}
+void ZF::CommitStagedFiles(ZFile* f) {
+    auto staging_dir = GetStagingDir(f);
+    if (!fs::exists(staging_dir)) return;
+    for (const auto& gen_file : f->_gen_files) {
+        if (!StringBeginWith(gen_file, *AccessBuildRootDir())) continue;
+        auto staged_file = staging_dir + gen_file.substr(AccessBuildRootDir()->size());
+        if (!fs::exists(staged_file)) continue;
+        if (!CommitStagedFile(staged_file, gen_file) && *AccessDebugLevel() > 0) {
+            printf("> %s is regenerated without any change, keep the old one\n", gen_file.data());
+        }
+    }
+    std::error_code ec;
+    fs::remove_all(staging_dir, ec);
+}
+
+#if __has_include(<elf.h>)
+template <typename Ehdr, typename Shdr, typename Sym, typename Dyn, typename Verdef, typename Verdaux>
+std::string DumpElfInterface(const std::string& data) {
+    auto read_fn = [&data](size_t off, auto* out) {
+        if (off > data.size() || sizeof(*out) > data.size() - off) return false;
+        memcpy(out, data.data() + off, sizeof(*out));
+        return true;
+    };
+    Ehdr eh;
+    if (!read_fn(0, &eh) || sizeof(Shdr) != eh.e_shentsize) return "";
+    std::vector<Shdr> shdrs(eh.e_shnum);
+    for (size_t i = 0; i < shdrs.size(); ++i) {
+        if (!read_fn(eh.e_shoff + i * sizeof(Shdr), &shdrs[i])) return "";
+    }
+    auto section_fn = [&shdrs](uint32_t type) -> const Shdr* {
+        for (const auto& sh : shdrs) if (type == sh.sh_type) return &sh;
+        return nullptr;
+    };
+    auto str_fn = [&](const Shdr* sh, size_t off) -> std::string {
+        if (!sh || sh->sh_link >= shdrs.size()) return "";
+        const auto& strtab = shdrs[sh->sh_link];
+        if (off >= strtab.sh_size || strtab.sh_offset + off >= data.size()) return "";
+        const char* p = data.data() + strtab.sh_offset + off;
+        return std::string(p, strnlen(p, std::min<size_t>(strtab.sh_size - off,
+                data.size() - strtab.sh_offset - off)));
+    };
+
+    std::string result;
+    if (auto dynamic = section_fn(SHT_DYNAMIC)) {
+        Dyn dyn;
+        for (size_t off = 0; off + sizeof(Dyn) <= dynamic->sh_size; off += sizeof(Dyn)) {
+            if (!read_fn(dynamic->sh_offset + off, &dyn) || DT_NULL == dyn.d_tag) break;
+            if (DT_SONAME == dyn.d_tag) result += "SONAME " + str_fn(dynamic, dyn.d_un.d_val) + "\n";
+        }
+    }
+    std::map<uint16_t, std::string> versions;
+    if (auto verdef = section_fn(SHT_GNU_verdef)) {
+        Verdef vd;
+        Verdaux vda;
+        size_t off = verdef->sh_offset;
+        for (size_t i = 0; i < verdef->sh_info && read_fn(off, &vd); ++i) {
+            if (vd.vd_cnt > 0 && read_fn(off + vd.vd_aux, &vda)) {
+                versions[vd.vd_ndx] = str_fn(verdef, vda.vda_name);
+                result += StringPrintf("VERDEF %u %s%s\n", (uint32_t)vd.vd_ndx,
+                        versions[vd.vd_ndx].data(), (vd.vd_flags & VER_FLG_BASE) ? " BASE" : "");
+            }
+            if (0 == vd.vd_next) break;
+            off += vd.vd_next;
+        }
+    }
+
+    auto dynsym = section_fn(SHT_DYNSYM);
+    if (!dynsym) return result;
+    auto versym = section_fn(SHT_GNU_versym);
+    std::vector<std::string> symbols;
+    Sym sym;
+    for (size_t i = 1; (i + 1) * sizeof(Sym) <= dynsym->sh_size; ++i) {
+        if (!read_fn(dynsym->sh_offset + i * sizeof(Sym), &sym)) return "";
+        auto bind = ELF32_ST_BIND(sym.st_info);
+        auto type = ELF32_ST_TYPE(sym.st_info);
+        auto visibility = ELF32_ST_VISIBILITY(sym.st_other);
+        //only the symbols defined and exported by this library belong to its interface
+        if (SHN_UNDEF == sym.st_shndx || STB_LOCAL == bind) continue;
+        if (STV_HIDDEN == visibility || STV_INTERNAL == visibility) continue;
+        auto line = str_fn(dynsym, sym.st_name);
+        uint16_t ver = 0;
+        if (versym && read_fn(versym->sh_offset + i * sizeof(ver), &ver) && (ver & 0x7fff) > 1) {
+            line += ((ver & 0x8000) ? "@" : "@@") + versions[ver & 0x7fff];
+        }
+        line += StringPrintf(" type:%u bind:%u vis:%u", type, bind, visibility);
+        //the size of data symbols is part of the ABI because of copy relocations
+        if (STT_OBJECT == type || STT_TLS == type || STT_COMMON == type) {
+            line += StringPrintf(" size:%lu", (unsigned long)sym.st_size);
+        }
+        symbols.push_back(line);
+    }
+    std::sort(symbols.begin(), symbols.end());
+    for (const auto& line : symbols) result += line + "\n";
+    return result;
+}
+
+//dump the interface of an ELF shared library, including its SONAME, version definitions and all
+//the exported dynamic symbols, which only changes when the ABI changes; return "" if the file is
+//not a valid ELF file
+std::string DumpSharedLibraryInterface(const std::string& so_file) {
+    std::ifstream f(so_file, std::ios::binary);
+    if (!f.is_open()) return "";
+    std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (data.size() < EI_NIDENT || 0 != memcmp(data.data(), ELFMAG, SELFMAG)) return "";
+    const uint16_t endian_probe = 1;
+    const int host_data = (1 == *(const uint8_t*)&endian_probe) ? ELFDATA2LSB : ELFDATA2MSB;
+    if (host_data != data[EI_DATA]) return "";
+    if (ELFCLASS64 == data[EI_CLASS]) {
+        return DumpElfInterface<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym, Elf64_Dyn, Elf64_Verdef,
+                Elf64_Verdaux>(data);
+    } else if (ELFCLASS32 == data[EI_CLASS]) {
+        return DumpElfInterface<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym, Elf32_Dyn, Elf32_Verdef,
+                Elf32_Verdaux>(data);
+    }
+    return "";
+}
+#else
+//no <elf.h>(e.g.: on macOS), so the whole library is compared instead of its interface
+std::string DumpSharedLibraryInterface(const std::string& so_file) { return ""; }
+#endif
+
+//regenerate the interface stub of the shared library, and return whether the stub is changed; the
+//stub won't be rewritten if it has no change, so that its mtime can be used by dependents
+bool UpdateInterfaceFile(const std::string& so_file, const std::string& interface_file) {
+    auto content = DumpSharedLibraryInterface(so_file);
+    //not an ELF file, so any change of the library is regarded as an interface change
+    if ("" == content) content = "MD5 " + FileMd5(so_file) + "\n";
+    if (!fs::exists(interface_file) || content != StringFromFile(interface_file)) {
+        StringToFile(content, interface_file);
+        AcquireFileMTime(interface_file, true);
+    }
+    return Md5Cache::Update(interface_file);
+}
+
 bool ZFile::Build() {
-    bool debug_flag = true;
-    if (_build_done && !_forced_build) return _has_been_built;
+    if (HasState(NS_BUILD_DONE) && !HasState(NS_FORCED_BUILD)) return HasState(NS_HAS_BEEN_BUILT);
+    ExternalProjectGuard guard(_ext_prj);
 
-    bool build_dependencies = false;
+    //why it needs to be rebuilt(empty means it's up to date), and the changed input that originally
+    //triggers the rebuild, which is tracked through deps in explain mode
+    std::string reason, origin;
+    ZFile* failed_dep = nullptr;
     for (auto dep : GetDeps()) {
         bool build_res = dep->Build();
-        build_dependencies |= build_res;
-        if (*AccessDebugLevel() > 0 && debug_flag && build_dependencies) {
-            printf("> build %s since the dependency '%s' has been built\n",
-                    _file.data(), dep->GetFilePath().data());
-            debug_flag = false;
+        if (dep->HasState(NS_BUILD_FAILED) && !failed_dep) failed_dep = dep;
+        if (build_res && "" == reason) {
+            reason = StringPrintf("the dependency '%s' has been built", FP(dep));
+            origin = ZF::GetBuildOrigin(dep);
         }
     }
 
+    if (failed_dep) {
+        //some deps might have been updated, so drop the '.cmd' to force a rebuild next time
+        if (*AccessDebugLevel() > 0) {
+            printf("> skip %s since the dependency '%s' failed\n", _file.data(), FP(failed_dep));
+        }
+        std::error_code ec;
+        fs::remove(GetBuildPath(_file) + ".cmd", ec);
+        SetState(NS_BUILD_FAILED);
+        SetState(NS_BUILD_DONE);
+        return false;
+    }
+
     if (!ComposeCommand()) return false;
 
-    bool need_build = (build_dependencies || !fs::exists(_file) ||
-            fs::is_empty(_file) || _forced_build);
-    if (*AccessDebugLevel() > 0 && debug_flag && need_build) {
-        if (!fs::exists(_file)) {
-            printf("> build %s since it doesn't exist\n", _file.data());
-        } else if (_forced_build) {
-            printf("> build %s since _forced_build == true\n", _file.data());
+    auto missing_gen_file = std::find_if(_gen_files.begin(), _gen_files.end(),
+            [](const std::string& f) { return !fs::exists(f); });
+    if ("" == reason) {
+        origin = _file;
+        if (!fs::exists(_file)) reason = "it doesn't exist";
+        else if (fs::is_empty(_file)) reason = "it's empty";
+        else if (HasState(NS_FORCED_BUILD)) reason = "it's forced to be rebuilt";
+        else if (_gen_files.end() != missing_gen_file) {
+            reason = StringPrintf("'%s' doesn't exist", missing_gen_file->data());
+            origin = *missing_gen_file;
         }
-        debug_flag = false;
     }
-    if (!need_build) need_build = (_cmd != StringFromFile(GetBuildPath(_file) + ".cmd"));
-    if (*AccessDebugLevel() > 0 && debug_flag && need_build) {
-        printf("> build %s since the cmd '%s' has been changed to '%s'\n", _file.data(),
-                StringFromFile(GetBuildPath(_file) + ".cmd").data(), _cmd.data());
-        debug_flag = false;
+    const auto cmd_file = GetBuildPath(_file) + ".cmd";
+    const auto cmd_sign = GetCommandSignature(_cmd, _rsp_files);
+    const bool cmd_changed = (cmd_sign != ReadCommandSignature(cmd_file));
+    //the file generated by its dep has no cmd of its own
+    if ("" == reason && "" != _cmd && cmd_changed) {
+        reason = fs::exists(cmd_file) ? "its cmd has been changed" : "its cmd has never been recorded";
+        origin = cmd_file;
+        if (*AccessDebugLevel() > 0) {
+            printf("> the cmd of %s has been changed from '%s' to '%s'\n", _file.data(),
+                    StringFromFile(cmd_file).data(), _cmd.data());
+        }
     }
-    if (!need_build) {
-        auto mtime = AcquireFileMTime(_file);
+    if ("" == reason) {
+        //the '.proto' file is the input of ZProto, so it's compared with the generated files
+        auto mtime = (FT_PROTO_FILE == GetFileType()) ? LONG_MAX : ZF::GetMTime(this);
+        for (const auto& f : _gen_files) mtime = std::min(mtime, AcquireFileMTime(f));
+        //(input, its mtime), where the mtimes of deps are cached in the node table, and a missing
+        //input(whose mtime is -1) is skipped
+        std::vector<std::pair<const std::string*, long>> inputs;
+        if (FT_PROTO_FILE == GetFileType()) inputs.emplace_back(&_file, AcquireFileMTime(_file));
         for (auto dep : GetDeps()) {
-            if (!fs::exists(dep->GetFilePath())) continue;
-            if (AcquireFileMTime(dep->GetFilePath()) >= mtime) {
-                if ('@' != Md5Cache::Get(dep->GetFilePath()).at(0)) continue; //md5 has no change
-                need_build = true;
-                if (*AccessDebugLevel() > 0 && debug_flag && need_build) {
-                    printf("> build %s since the mtime(%ld) of dependence '%s' is bigger than "
-                            "target's mtime(%ld)\n", _file.data(),
-                            AcquireFileMTime(dep->GetFilePath()),
-                            dep->GetFilePath().data(), mtime);
-                    debug_flag = false;
-                }
+            const auto& itf = dep->_interface_file;
+            auto itf_mtime = ("" != itf) ? AcquireFileMTime(itf) : -1;
+            if (itf_mtime >= 0) inputs.emplace_back(&itf, itf_mtime);
+            else inputs.emplace_back(&dep->GetFilePath(), ZF::GetMTime(dep));
+        }
+        for (const auto& input : inputs) {
+            if (input.second < 0) continue;
+            if (input.second >= mtime) {
+                if ('@' != Md5Cache::Get(*input.first).at(0)) continue; //md5 has no change
+                reason = StringPrintf("the content of dependence '%s' has been changed(mtime: %ld, "
+                        "target's mtime: %ld)", input.first->data(), input.second, mtime);
+                origin = *input.first;
                 break;
             }
         }
     }
-    if (need_build) {
-        _has_been_built = true;
-        if (_generated_by_dep) {
+    const bool need_build = ("" != reason);
+    if (*AccessDebugLevel() > 0 && need_build) printf("> build %s since %s\n", _file.data(), reason.data());
+    if (need_build && *AccessExplainMode()) {
+        ZF::ExplainBuild(this, reason, origin);
+        SetState(NS_HAS_BEEN_BUILT);
+        SetState(NS_FORCED_BUILD, false);
+    } else if (need_build && HasState(NS_BATCHED)) {
+        //the cmd will be executed later by ZF::ApplyProtoBatches together with others
+        SetState(NS_HAS_BEEN_BUILT);
+        SetState(NS_FORCED_BUILD, false);
+    } else if (need_build) {
+        SetState(NS_HAS_BEEN_BUILT);
+        if (HasState(NS_GENERATED_BY_DEP)) {
             for (auto dep : GetDeps()) {
                 if (fs::exists(_file)) break;
                 if (*AccessDebugLevel() > 0) {
                     printf("> generate %s by build dep(%s)\n", _file.data(),
                             dep->GetFilePath().data());
                 }
-                dep->_forced_build = true;
+                dep->SetState(NS_FORCED_BUILD);
                 dep->Build();
+                if (dep->HasState(NS_BUILD_FAILED)) SetState(NS_BUILD_FAILED);
+            }
+            //the dep has regenerated this file, so check whether its content really changed
+            if (!HasState(NS_BUILD_FAILED) && fs::exists(_file)) {
+                AcquireFileMTime(_file, true);
+                if (!Md5Cache::Update(_file)) {
+                    if (*AccessDebugLevel() > 0) {
+                        printf("> %s is regenerated without any change\n", _file.data());
+                    }
+                    SetState(NS_HAS_BEEN_BUILT, false);
+                }
             }
         } else {
-            StringToFile(_cmd, GetBuildPath(_file) + ".cmd");
-            ZF::ExecuteBuild(this);
-            if (_forced_build) _forced_build = false;
+            WriteResponseFiles(_rsp_files);
+            //'.cmd' is only recorded after the build succeeds, so the output of a failed or killed
+            //build will never be regarded as an up-to-date one
+            std::error_code ec;
+            fs::remove(cmd_file, ec);
+            _exec_cmd = ComposeExecCommand(cmd_changed);
+            //the output of a generator rule is overwritten in place, so keep the old one as the staged
+            //copy to restore it(and its mtime) if the regenerated one is byte-identical
+            const bool by_rule = (FT_PROTO_FILE != GetFileType() && fs::exists(_file) &&
+                    (_generator || GetDefaultGenerator(fs::path(_file).extension())));
+            const auto staged_file = GetBuildPath(_file) + ".staged";
+            if (by_rule) {
+                fs::copy_file(_file, staged_file, FSCO::overwrite_existing);
+                fs::last_write_time(staged_file, fs::last_write_time(_file));
+            }
+            const bool build_ok = ZF::ExecuteBuild(this);
+            if (by_rule) {
+                if (build_ok && fs::exists(_file) && FileMd5(_file) == FileMd5(staged_file)) {
+                    fs::rename(staged_file, _file);
+                } else fs::remove(staged_file, ec);
+            }
+            if (build_ok) {
+                if (FT_PROTO_FILE == GetFileType()) ZF::CommitStagedFiles(this);
+                StringToFile(cmd_sign + "\n" + _cmd, cmd_file);
+                AcquireFileMTime(_file, true);
+                for (const auto& f : _gen_files) AcquireFileMTime(f, true);
+                //early cutoff: if the output is byte-identical to the one of last build, all its
+                //dependents needn't be rebuilt; the generated files of ZProto are checked by themselves
+                bool changed = (FT_PROTO_FILE == GetFileType() || Md5Cache::Update(_file));
+                //for a shared library, only the change of its exported interface matters
+                if ("" != _interface_file) changed = UpdateInterfaceFile(_file, _interface_file);
+                if (!changed) {
+                    if (*AccessDebugLevel() > 0) {
+                        printf("> %s is rebuilt without any %schange, skip rebuilding its "
+                                "dependents\n", _file.data(), "" != _interface_file ? "interface " : "");
+                    }
+                    SetState(NS_HAS_BEEN_BUILT, false);
+                }
+            }
+            SetState(NS_FORCED_BUILD, false);
         }
     }
 
-    _build_done = true;
-    return _has_been_built;
+    SetState(NS_BUILD_DONE);
+    return HasState(NS_HAS_BEEN_BUILT);
 }
 
 ZObject::ZObject(const std::string& src_file, const std::string& obj_file):
@@ -758,20 +1839,136 @@ ZObject::ZObject(const std::string& src_file, const std::string& obj_file):
     _src = fs::absolute(src_file).lexically_normal();
     _compiler = *AccessDefaultCompiler(fs::path(_src).extension());
     _file = GetBuildPath("" == obj_file ?
-            StringReplaceSuffix(_src, C_CPP_SOURCE_SUFFIXES, ".o") : obj_file);
+            ReplaceSourceSuffix(_src, ".o") : obj_file);
+    if (fs::exists(_file + ".d")) LoadDepFile();
+    else RegisterRunnerAfterBuildAll([this]() { LoadDepFile(); });
+}
+
+void ZObject::LoadDepFile() {
     auto dep_file = _file + ".d";
-    auto load_dep_file_fn = [this, dep_file]() {
-        if (!fs::exists(dep_file)) return;
-        auto s = StringFromFile(dep_file);
-        auto parts = StringSplit(s, ':');
-        if (2 != parts.size()) ZTHROW("can't parse the dependence file(%s)", dep_file.data());
-        for (auto dep : StringSplit(StringRightTrim(StringReplaceAll(parts[1], "\\\n", "")), ' ')) {
-            //skip check fs::exists(dep), e.g. header file renamed
-            AddDep(AccessFile(dep));
+    if (!fs::exists(dep_file)) return;
+    //besides the rule of the obj, there might be some rules for C++20 modules, such as:
+    //'a.c++m: a.gcm', '.PHONY: a.c++m' and 'CXX_IMPORTS += b.c++m', which are skipped
+    std::vector<std::string> deps;
+    for (const auto& rule : StringSplit(StringReplaceAll(StringFromFile(dep_file), "\\\n", ""), '\n')) {
+        auto p = rule.find(": ");
+        if (std::string::npos == p) continue;
+        auto targets = StringSplit(rule.substr(0, p), ' ');
+        bool is_obj_rule = (targets.end() != std::find(targets.begin(), targets.end(), _file));
+        if (!deps.empty() && !is_obj_rule) continue;
+        deps = StringSplit(StringRightTrim(rule.substr(p + 2)), ' ');
+        if (is_obj_rule) break;
+    }
+    if (deps.empty()) ZTHROW("can't parse the dependence file(%s)", dep_file.data());
+    for (const auto& dep : deps) {
+        //the imported modules are tracked by ZF::ApplyModules
+        if (StringEndWith(dep, ".c++m")) continue;
+        //skip check fs::exists(dep), e.g. header file renamed
+        AddDep(AccessFile(dep));
+    }
+}
+
+//the '#include' directives of 'file' as (is_quoted, header) pairs, which are parsed only once; the
+//conditional compilation is ignored, so it might contain some headers that aren't really included
+const std::vector<std::pair<bool, std::string>>& ParseIncludeDirectives(const std::string& file) {
+    using Directives = std::vector<std::pair<bool, std::string>>;
+    static std::unordered_map<std::string, std::shared_ptr<Directives>> s_file_directives;
+    static std::mutex s_mtx;
+
+    std::shared_ptr<Directives> res;
+    RunWithLock(s_mtx, [&]() { if (s_file_directives.count(file)) res = s_file_directives[file]; });
+    if (res) return *res;
+
+    res = std::make_shared<Directives>();
+    for (const auto& line : StringSplit(StringFromFile(file), '\n')) {
+        size_t p = line.find_first_not_of(" \t");
+        if (std::string::npos == p || '#' != line[p]) continue;
+        p = line.find_first_not_of(" \t", p + 1);
+        if (std::string::npos == p || 0 != line.compare(p, 7, "include")) continue;
+        p = line.find_first_not_of(" \t", p + 7);
+        if (std::string::npos == p || ('"' != line[p] && '<' != line[p])) continue;
+        auto end = line.find('"' == line[p] ? '"' : '>', p + 1);
+        if (std::string::npos != end) res->emplace_back('"' == line[p], line.substr(p + 1, end - p - 1));
+    }
+    RunWithLock(s_mtx, [&]() {
+        auto& x = s_file_directives[file];
+        if (!x) x = res;
+        res = x;
+    });
+    return *res;
+}
+
+void ZF::ScanIncludes(const std::vector<ZFile*>& files) {
+    std::vector<ZObject*> objs;
+    ProcessDepsRecursively(files, [&](ZFile* f) {
+        if (FT_OBJ_FILE != f->GetFileType() || fs::exists(f->_file + ".d")) return;
+        auto obj = (ZObject*)f;
+        //the include dirs of libs are calculated lazily, so it can't be done concurrently
+        ExternalProjectGuard guard(obj->_ext_prj);
+        obj->CollectIncludeDirs();
+        objs.push_back(obj);
+    });
+    if (objs.empty()) return;
+
+    //a header is found if it exists or it will be generated, e.g.: '.pb.h'; and the files which don't
+    //exist yet are not scanned further
+    auto& global_files = GlobalFiles();
+    std::unordered_map<std::string, bool> file_existences;
+    std::mutex mtx;
+    auto exists_fn = [&](const std::string& path) {
+        int res = -1;
+        RunWithLock(mtx, [&]() { if (file_existences.count(path)) res = file_existences[path]; });
+        if (-1 == res) {
+            res = fs::is_regular_file(path);
+            RunWithLock(mtx, [&]() { file_existences[path] = res; });
         }
+        return 1 == res;
     };
-    if (fs::exists(dep_file)) load_dep_file_fn();
-    else RegisterRunnerAfterBuildAll(load_dep_file_fn);
+
+    std::vector<std::vector<std::string>> obj_headers(objs.size());
+    std::atomic<size_t> next_idx{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < JobSlots::GetTotal(); ++i) {
+        threads.emplace_back([&]() {
+            for (size_t idx = next_idx++; idx < objs.size(); idx = next_idx++) {
+                auto obj = objs[idx];
+                std::set<std::string> visited;
+                std::vector<std::string> pending = {obj->_src};
+                while (!pending.empty()) {
+                    auto file = pending.back();
+                    pending.pop_back();
+                    for (const auto& x : ParseIncludeDirectives(file)) {
+                        std::vector<std::string> dirs;
+                        if (x.first) dirs.push_back(GetDirnameFromPath(file));
+                        dirs.insert(dirs.end(), obj->_inc_dirs.begin(), obj->_inc_dirs.end());
+                        for (const auto& dir : dirs) {
+                            std::string header = fs::path(dir + "/" + x.second).lexically_normal();
+                            bool existed = exists_fn(header);
+                            if (!existed) {
+                                auto iter = global_files.find(header);
+                                if (global_files.end() == iter || !iter->second) continue;
+                            }
+                            if (visited.insert(header).second) {
+                                obj_headers[idx].push_back(header);
+                                if (existed) pending.push_back(header);
+                            }
+                            break;
+                        }
+                    }
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    size_t header_num = 0;
+    for (size_t idx = 0; idx < objs.size(); ++idx) {
+        for (const auto& header : obj_headers[idx]) objs[idx]->AddDep(AccessFile(header));
+        header_num += obj_headers[idx].size();
+    }
+    if (*AccessDebugLevel() > 0) {
+        printf("> scanned %lu header dependencies for %lu objs without '.d' files\n", header_num, objs.size());
+    }
 }
 
 std::string ZObject::GetSourceFile() const {
@@ -795,35 +1992,79 @@ void ZObject::AddObjectUser(ZFile* file) {
     _users.push_back(file);
 }
 
+void ZObject::CollectIncludeDirs() {
+    std::set<ZFile*> uniq_deps = GlobalOpaqueFiles();
+    auto handle_dep_fn = [&](ZFile* dep) {
+        if (FT_LIB_FILE == dep->GetFileType()) {
+            for (auto inc_dir : ((ZLibrary*)dep)->GetIncludeDirs()) AddIncludeDir(inc_dir);
+        }
+    };
+    //it makes sense to add project root as one include path
+    AddIncludeDir(*AccessProjectRootDir());
+    ProcessDepsRecursively(GetDeps(), handle_dep_fn, &uniq_deps);
+    ProcessDepsRecursively(_users, handle_dep_fn, &uniq_deps);
+}
+
 bool ZObject::ComposeCommand() {
     if ("" == _cmd) {
         _cmd = StringPrintf("%s -c -o %s -MD -MF %s.d", _compiler.data(), _file.data(), _file.data());
+        _rsp_files.clear();
 
-        std::set<ZFile*> uniq_deps;
-        auto handle_dep_fn = [&](ZFile* dep) {
-            if (FT_LIB_FILE == dep->GetFileType()) {
-                for (auto inc_dir : ((ZLibrary*)dep)->GetIncludeDirs()) AddIncludeDir(inc_dir);
-            }
-        };
-        //it makes sense to add project root as one include path
-        AddIncludeDir(*AccessProjectRootDir());
-        ProcessDepsRecursively(GetDeps(), handle_dep_fn, &uniq_deps);
-        ProcessDepsRecursively(_users, handle_dep_fn, &uniq_deps);
-
+        CollectIncludeDirs();
+        std::string inc_args;
         for (const auto& inc : _inc_dirs) {
             //avoid hiding system header like <string.h>
-            _cmd += StringPrintf(" -idirafter %s", inc.data());
+            inc_args += StringPrintf(" -idirafter %s", inc.data());
         }
+        std::string tail_args;
         if (_conf) {
-            _cmd += " " + _conf->ToString(DefaultObjectConfig());
+            tail_args += " " + _conf->ToString(DefaultObjectConfig());
         } else {
-            _cmd += " " + DefaultObjectConfig()->ToString();
+            tail_args += " " + DefaultObjectConfig()->ToString();
         }
-        _cmd += " " + _src;
+        tail_args += GetFastLinkCompileFlags();
+        tail_args += GetLtoCompileFlags(_lto_mode, _compiler, _has_non_lto_user);
+        //the CMI files of the provided module and all the imported ones, see ZF::ApplyModules
+        if ("" != _module || !_module_map.empty()) {
+            if (IsClangCompiler(_compiler)) {
+                for (const auto& x : _module_map) {
+                    if (x.first == _module) tail_args += " -fmodule-output=" + x.second;
+                    else if ('/' == x.first.at(0)) tail_args += " -fmodule-file=" + x.second;
+                    else tail_args += " -fmodule-file=" + x.first + "=" + x.second;
+                }
+            } else {
+                std::string mapper;
+                for (const auto& x : _module_map) mapper += x.first + " " + x.second + "\n";
+                _rsp_files.emplace_back(_file + ".modmap", mapper);
+                tail_args += " -fmodules-ts -fmodule-mapper=" + _file + ".modmap";
+                //gcc doesn't know the suffixes of module interface units
+                if (StringEndWith(_src, CPP_MODULE_SUFFIXES)) tail_args += " -x c++";
+            }
+        }
+        tail_args += " " + _src;
+        //the debug info is split into the '.dwo' file next to the obj
+        _gen_files.clear();
+        if (*AccessFastLinkMode()) _gen_files.push_back(StringReplaceSuffix(_file, ".o", ".dwo"));
+        if ("" != _module) _gen_files.push_back(_module_map[_module]);
+        //objs with the same include dirs share one response file, which is named by its md5
+        _cmd += UseResponseFileIfNeeded(inc_args, _cmd.size() + tail_args.size(),
+                *AccessBuildRootDir() + ".rsp/" + StringMd5(inc_args) + ".rsp", &_rsp_files);
+        _cmd += tail_args;
+        if (_variant) ApplyVariantFlags(_cmd, _variant->GetCompileConfig());
+        //the self-profile flags are only added to '_exec_cmd', so all objs are forced to be rebuilt
+        if (*AccessTimeTraceMode()) SetState(NS_FORCED_BUILD);
     }
     UpdateOptimizationLevel(_cmd);
     return true;
 }
+std::string ZObject::ComposeExecCommand(bool cmd_changed) {
+    if (!*AccessTimeTraceMode()) return _cmd;
+    if (IsClangCompiler(_compiler)) return _cmd + " -ftime-trace";
+    //gcc prints the report to stderr following the diagnostics, so only the diagnostics are kept
+    auto report = GetTimeTraceFile(_file, _compiler);
+    return StringPrintf("%s -ftime-report 2>%s; rc=$?; sed '/^Time variable/,$d;/^$/d' %s >&2; exit $rc",
+            _cmd.data(), report.data(), report.data());
+}
 //TODO support always_link = true
 ZLibrary::ZLibrary(const std::string& lib_name, bool is_static_lib): ZFile("", FT_LIB_FILE, true) {
     _name = lib_name;
@@ -837,6 +2078,7 @@ ZLibrary::ZLibrary(const std::string& lib_name, bool is_static_lib): ZFile("", F
     _file = GetBuildPath(lib_file);
     _compiler = *AccessDefaultCompiler(fs::path(_file).extension());
     _is_static_lib = is_static_lib;
+    if (!_is_static_lib) _interface_file = _file + ".ifs";
 }
 ZLibrary::ZLibrary(const std::string& name, const std::vector<std::string>& inc_dirs,
         const std::string& lib_file): ZFile("", FT_LIB_FILE, false) {
@@ -851,7 +2093,7 @@ ZLibrary::ZLibrary(const std::string& name, const std::vector<std::string>& inc_
 std::string GetObjBindName(const std::string& src, const std::string& bind_name) {
     std::string suffix = StringReplaceAll(bind_name, "/", "-");
     suffix = StringReplaceAll(suffix, ".", "-");
-    return StringReplaceSuffix(src, C_CPP_SOURCE_SUFFIXES, suffix + ".o");
+    return ReplaceSourceSuffix(src, suffix + ".o");
 }
 
 ZLibrary* ZLibrary::AddObjs(const std::vector<std::string>& src_files, bool bind_flag) {
@@ -899,7 +2141,10 @@ ZLibrary* ZLibrary::AddProtos(const std::vector<std::string>& proto_files) {
 }
 
 const std::set<std::string>& ZLibrary::GetIncludeDirs() {
+    ExternalProjectGuard guard(_ext_prj);
     if (_inc_dirs.empty()) {
+        //the same as ImportExternalZmakeProject, the root dir of the external project is included
+        if ("" != _ext_prj) _inc_dirs.insert(*AccessProjectRootDir());
         bool all_srcs_are_pb_cc = !_objs.empty();
         for (auto obj : _objs) {
             if (!StringEndWith(obj->GetSourceFile(), ".pb.cc")) {
@@ -974,42 +2219,54 @@ bool ZLibrary::ComposeCommand() {
         if (_is_static_lib) {
             if (_objs.empty()) {
                 if (GetDeps().empty()) ZTHROW("found uninitialized library(%s)", _name.data());
-                _build_done = true;
+                SetState(NS_BUILD_DONE);
                 return false;
             }
-            _cmd = StringPrintf("%s", _file.data());
+            _cmd = _file;
+            if (AM_THIN == GetArchiveMode()) {
+                std::vector<std::string> members;
+                for (auto obj : _objs) members.push_back(obj->GetFilePath());
+                Md5Cache::SetMembers(_file, members);
+            }
         } else {
             _cmd = StringPrintf("%s -shared -o %s", _compiler.data(), _file.data());
         }
+        _rsp_files.clear();
+        std::string args;
         for (auto obj : _objs) {
-            _cmd += StringPrintf(" %s", obj->GetFilePath().data());
+            args += StringPrintf(" %s", obj->GetFilePath().data());
         }
         for (auto lib : _libs) {
             if (lib->IsUsedAsWholeArchive()) {
-                _cmd += " -Wl,--whole-archive";
-                _cmd += StringPrintf(" %s", lib->GetFilePath().data());
-                _cmd += " -Wl,--no-whole-archive";
-            } else _cmd += StringPrintf(" %s", lib->GetFilePath().data());
+                args += " -Wl,--whole-archive";
+                args += StringPrintf(" %s", lib->GetFilePath().data());
+                args += " -Wl,--no-whole-archive";
+            } else args += StringPrintf(" %s", lib->GetFilePath().data());
         }
         if (!_whole_archive_libs.empty()) {
-            _cmd += " -Wl,--whole-archive";
+            args += " -Wl,--whole-archive";
             for (auto lib : _whole_archive_libs) {
-                _cmd += StringPrintf(" %s", lib->GetFilePath().data());
+                args += StringPrintf(" %s", lib->GetFilePath().data());
             }
-            _cmd += " -Wl,--no-whole-archive";
+            args += " -Wl,--no-whole-archive";
         }
         if (_is_static_lib) {
-             if (_conf) {
-                 _cmd = _compiler + " " + _conf->ToString(DefaultStaticLibraryConfig()) + " " + _cmd;
-             } else {
-                 _cmd = _compiler + " " + DefaultStaticLibraryConfig()->ToString() + " " + _cmd;
-             }
+             auto prefix = GetArchiverPrefix();
+             _cmd = prefix + _cmd + UseResponseFileIfNeeded(args, prefix.size() + _cmd.size(),
+                     _file + ".rsp", &_rsp_files);
         } else {
+            std::string conf_args;
             if (_conf) {
-                _cmd += " " + _conf->ToString(DefaultSharedLibraryConfig());
+                conf_args = " " + _conf->ToString(DefaultSharedLibraryConfig());
             } else {
-                _cmd += " " + DefaultSharedLibraryConfig()->ToString();
+                conf_args = " " + DefaultSharedLibraryConfig()->ToString();
             }
+            conf_args += GetFastLinkLinkFlags();
+            conf_args += GetLtoLinkFlags(*AccessLtoMode(), _compiler, conf_args);
+            _cmd += UseResponseFileIfNeeded(args, _cmd.size() + conf_args.size(),
+                    _file + ".rsp", &_rsp_files);
+            _cmd += conf_args;
+            if (_variant) ApplyVariantFlags(_cmd, _variant->GetLinkConfig());
         }
     }
 
@@ -1019,6 +2276,700 @@ bool ZLibrary::ComposeCommand() {
     return true;
 }
 
+ArchiveMode ZLibrary::GetArchiveMode() const {
+    return _archive_mode < 0 ? *AccessArchiveMode() : (ArchiveMode)_archive_mode;
+}
+std::string ZLibrary::GetArchiverPrefix() const {
+    auto prefix = _compiler + (AM_THIN == GetArchiveMode() ? " --thin " : " ");
+    if (_conf) return prefix + _conf->ToString(DefaultStaticLibraryConfig()) + " ";
+    return prefix + DefaultStaticLibraryConfig()->ToString() + " ";
+}
+std::string ZLibrary::ComposeExecCommand(bool cmd_changed) {
+    if (!_is_static_lib) return ComposeLtoExecCommand(*AccessLtoMode());
+    //'ar r' never drops the members which are removed from the cmd, so recreate the archive
+    if (AM_FULL == GetArchiveMode() || cmd_changed || !fs::exists(_file)) {
+        return StringPrintf("rm -f %s && %s", _file.data(), _cmd.data());
+    }
+    //the objs list is unchanged, so only replace the members whose content really changed
+    auto mtime = AcquireFileMTime(_file);
+    std::string changed_objs;
+    for (auto obj : _objs) {
+        const auto& obj_file = obj->GetFilePath();
+        if (AcquireFileMTime(obj_file) < mtime) continue;
+        if ('@' == Md5Cache::Get(obj_file).at(0)) changed_objs += " " + obj_file;
+    }
+    if ("" == changed_objs) return StringPrintf("touch %s", _file.data());
+    //all objs are changed after a widely included header changes, so it needs a response file as well,
+    //which is only used by this exec cmd rather than being a part of the cmd signature
+    std::vector<std::pair<std::string, std::string>> rsp_files;
+    auto prefix = GetArchiverPrefix() + _file;
+    auto exec_cmd = prefix + UseResponseFileIfNeeded(changed_objs, prefix.size(), _file + ".changed.rsp",
+            &rsp_files);
+    WriteResponseFiles(rsp_files);
+    return exec_cmd;
+}
+
+std::string ZFile::ComposeLtoExecCommand(LtoMode mode) {
+    _job_weight = GetLtoJobWeight(mode, _compiler);
+    if (1 == _job_weight) return _cmd;
+    if (!IsClangCompiler(_compiler)) return _cmd + StringPrintf(" -flto=%d", _job_weight);
+    if (std::string::npos != _cmd.find("-fuse-ld=lld")) {
+        return _cmd + StringPrintf(" -Wl,--thinlto-jobs=%d", _job_weight);
+    }
+    return _cmd + StringPrintf(" -Wl,-plugin-opt,jobs=%d", _job_weight);
+}
+
+void ZF::ProcessLinkedObjects(ZFile* f, const std::function<void(ZObject*)>& fn) {
+    std::set<ZFile*> visited;
+    //the objs inside shared libs are linked by the shared libs themselves
+    std::function<void(ZFile*)> visit_fn = [&](ZFile* file) {
+        for (auto dep : file->GetDeps()) {
+            if (!visited.insert(dep).second) continue;
+            if (FT_OBJ_FILE == dep->GetFileType()) {
+                fn((ZObject*)dep);
+            } else if (FT_LIB_FILE == dep->GetFileType() && ((ZLibrary*)dep)->IsStaticLibrary()) {
+                visit_fn(dep);
+            }
+        }
+    };
+    visit_fn(f);
+}
+
+//decide the LTO mode of all objs by the binaries and shared libs which they're linked into, so it
+//should be called after all deps are resolved and before any obj is compiled
+void ZF::ApplyLTO() {
+    std::set<ZFile*> link_targets;
+    for (auto& x : GlobalFiles()) {
+        auto f = x.second;
+        if (!f || f->HasState(NS_BUILD_DONE)) continue;
+        if (FT_BINARY_FILE == f->GetFileType()) link_targets.insert(f);
+        if (FT_LIB_FILE == f->GetFileType() && !((ZLibrary*)f)->IsStaticLibrary()) link_targets.insert(f);
+    }
+    for (auto f : link_targets) {
+        auto mode = (FT_BINARY_FILE == f->GetFileType()) ? ((ZBinary*)f)->GetLtoMode() : *AccessLtoMode();
+        ProcessLinkedObjects(f, [mode](ZObject* obj) {
+            if (LTO_NONE == mode) obj->_has_non_lto_user = true;
+            else obj->_lto_mode = std::max(obj->_lto_mode, mode);
+        });
+    }
+    //the symbol table of an archive with LTO objs can only be created by the plugin-aware archiver
+    for (auto& x : GlobalFiles()) {
+        if (!x.second || FT_LIB_FILE != x.second->GetFileType()) continue;
+        auto lib = (ZLibrary*)x.second;
+        if (!lib->IsStaticLibrary() || "ar" != lib->_compiler) continue;
+        for (auto obj : lib->_objs) {
+            if (LTO_NONE == obj->_lto_mode) continue;
+            lib->_compiler = IsClangCompiler(obj->_compiler) ? "llvm-ar" : "gcc-ar";
+            break;
+        }
+    }
+}
+
+ZFile* ZF::CloneForVariant(ZFile* f, const std::string& variant, std::map<ZFile*, ZFile*>* clones,
+        bool clone_shared_libs) {
+    auto iter = clones->find(f);
+    if (clones->end() != iter) return iter->second;
+    const auto& build_root = *AccessBuildRootDir();
+    //the file whose cmd is set by SetFullCommand can't be cloned, since the cmd has its own paths
+    bool cloneable = ("" == f->_cmd && !f->HasState(NS_BUILD_DONE) && StringBeginWith(f->_file, build_root));
+    //the CMI file of a module is generated by its obj, so it's cloned with the obj
+    bool is_cmi = (f->HasState(NS_GENERATED_BY_DEP) && StringBeginWith(f->_file, build_root + ".modules/"));
+    const auto ft = f->GetFileType();
+    if (FT_LIB_FILE == ft) cloneable = cloneable && (clone_shared_libs || ((ZLibrary*)f)->IsStaticLibrary());
+    else if (FT_OBJ_FILE != ft && FT_BINARY_FILE != ft && !is_cmi) cloneable = false;
+    if (!cloneable) return (*clones)[f] = f;
+
+    auto variant_file_fn = [&](const std::string& p) {
+        return build_root + ".variants/" + variant + "/" + p.substr(build_root.size());
+    };
+    auto file = variant_file_fn(f->_file);
+    if (!*AccessExplainMode()) fs::create_directories(fs::path(file).parent_path());
+    ZFile* clone = nullptr;
+    if (FT_OBJ_FILE == f->GetFileType()) {
+        auto obj = Duplicate((ZObject*)f, file);
+        obj->_users.clear(); //the cloned users will add themselves
+        obj->LoadDepFile();
+        //the CMI files of modules are cloned as well, while the header units are shared
+        for (auto& x : obj->_module_map) if ('/' != x.first.at(0)) x.second = variant_file_fn(x.second);
+        clone = obj;
+    } else if (FT_LIB_FILE == f->GetFileType()) {
+        clone = Duplicate((ZLibrary*)f, file);
+        if ("" != clone->_interface_file) clone->_interface_file = file + ".ifs";
+    } else if (FT_BINARY_FILE == f->GetFileType()) {
+        clone = Duplicate((ZBinary*)f, file);
+    } else {
+        clone = Duplicate(f, file);
+    }
+    (*clones)[f] = clone;
+    GlobalFiles()[file] = clone;
+    RemapVariantDeps(clone, variant, clones, clone_shared_libs);
+    return clone;
+}
+void ZF::RemapVariantDeps(ZFile* f, const std::string& variant, std::map<ZFile*, ZFile*>* clones,
+        bool clone_shared_libs) {
+    for (uint32_t i = 0; i < GetDeps(f).size(); ++i) {
+        auto dep = CloneForVariant(GetDeps(f)[i], variant, clones, clone_shared_libs);
+        RunWithLock(GlobalGraphMutex(), [&]() {
+            auto& t = GlobalNodeTable();
+            t.edges[t.dep_begins[f->_id] + i] = dep->_id;
+        });
+    }
+    auto remap_fn = [&](auto& files) {
+        for (auto& x : files) {
+            x = (std::remove_reference_t<decltype(x)>)CloneForVariant(x, variant, clones, clone_shared_libs);
+        }
+    };
+    auto add_user_fn = [f](const std::vector<ZObject*>& objs) {
+        for (auto obj : objs) if (obj->_file != f->_file) obj->AddObjectUser(f);
+    };
+    if (FT_LIB_FILE == f->GetFileType()) {
+        auto lib = (ZLibrary*)f;
+        remap_fn(lib->_objs);
+        remap_fn(lib->_libs);
+        remap_fn(lib->_whole_archive_libs);
+        add_user_fn(lib->_objs);
+    } else if (FT_BINARY_FILE == f->GetFileType()) {
+        auto bin = (ZBinary*)f;
+        remap_fn(bin->_objs);
+        remap_fn(bin->_libs);
+        remap_fn(bin->_whole_archive_libs);
+        add_user_fn(bin->_objs);
+    }
+}
+struct ExplainedFile {
+    size_t seq; //in the order of building
+    std::string reason;
+    std::string origin;
+    long cost_ms; //the duration of its last build, -1 if it has never been built
+    long finish_ms; //the earliest finish time if there were enough '-j' slots
+};
+constexpr auto GlobalExplainedFiles = GlobalResource<std::map<ZFile*, ExplainedFile>, GRT_EXPLAINED_FILE>::Resource;
+
+void ZF::ExplainBuild(ZFile* f, const std::string& reason, const std::string& origin) {
+    auto& files = GlobalExplainedFiles();
+    long cost_ms = BuildTimes::Get(f->_file);
+    if (f->HasState(NS_GENERATED_BY_DEP)) {
+        //it's regenerated by its dep, which costs nothing extra if the dep is rebuilt as well
+        auto dep = f->GetDeps().empty() ? nullptr : f->GetDeps()[0];
+        cost_ms = (!dep || files.count(dep)) ? 0 : BuildTimes::Get(dep->_file);
+    }
+    files[f] = {files.size(), reason, origin, cost_ms, 0};
+}
+std::string ZF::GetBuildOrigin(ZFile* f) {
+    auto iter = GlobalExplainedFiles().find(f);
+    return GlobalExplainedFiles().end() != iter ? iter->second.origin : f->_file;
+}
+//the same as the '_job_weight' decided by ComposeLtoExecCommand, which isn't called in explain mode
+int ZF::GetJobWeight(ZFile* f) {
+    if (FT_BINARY_FILE == f->GetFileType()) return GetLtoJobWeight(((ZBinary*)f)->GetLtoMode(), f->_compiler);
+    if (FT_LIB_FILE == f->GetFileType() && !((ZLibrary*)f)->IsStaticLibrary()) {
+        return GetLtoJobWeight(*AccessLtoMode(), f->_compiler);
+    }
+    return 1;
+}
+void ZF::PrintExplanation() {
+    auto& files = GlobalExplainedFiles();
+    if (files.empty()) {
+        ColorPrint("* Explain: all targets are up to date\n", CT_BRIGHT_GREEN);
+        return;
+    }
+    std::vector<std::pair<ZFile*, ExplainedFile*>> ordered_files;
+    long known_ms = 0, unknown_num = 0;
+    for (auto& x : files) {
+        ordered_files.emplace_back(x.first, &x.second);
+        if (x.second.cost_ms < 0) ++unknown_num;
+        else known_ms += x.second.cost_ms;
+    }
+    std::sort(ordered_files.begin(), ordered_files.end(),
+            [](const auto& a, const auto& b) { return a.second->seq < b.second->seq; });
+    //the files which have never been built are estimated by the average duration of others
+    long avg_ms = (files.size() > (size_t)unknown_num) ? known_ms / (files.size() - unknown_num) : 0;
+    long total_ms = 0, critical_path_ms = 0;
+    ColorPrint(StringPrintf("* Explain: %lu file(s) would be rebuilt\n", files.size()), CT_BRIGHT_CYAN);
+    for (auto& x : ordered_files) {
+        auto& ef = *x.second;
+        long cost_ms = (ef.cost_ms < 0 ? avg_ms : ef.cost_ms);
+        long start_ms = 0;
+        for (auto dep : x.first->GetDeps()) {
+            auto iter = files.find(dep);
+            if (files.end() != iter) start_ms = std::max(start_ms, iter->second.finish_ms);
+        }
+        ef.finish_ms = start_ms + cost_ms;
+        critical_path_ms = std::max(critical_path_ms, ef.finish_ms);
+        total_ms += cost_ms * GetJobWeight(x.first);
+        printf("  %s(%s%ld ms) since %s\n    origin: %s\n", FP(x.first), ef.cost_ms < 0 ? "~" : "",
+                cost_ms, ef.reason.data(), ef.origin.data());
+    }
+    //the build can't be faster than its critical path, nor than all the work spread over all slots
+    auto wall_ms = std::max(critical_path_ms, total_ms / JobSlots::GetTotal());
+    ColorPrint(StringPrintf("* Estimated wall time with -j%d: %.1f s(critical path: %.1f s, total: %.1f s)\n",
+            JobSlots::GetTotal(), wall_ms / 1000.0, critical_path_ms / 1000.0, total_ms / 1000.0),
+            CT_BRIGHT_CYAN);
+    if (unknown_num > 0) {
+        printf("  %ld file(s) have never been built, their durations are estimated by the average(%ld ms)\n",
+                unknown_num, avg_ms);
+    }
+}
+
+//split the "traceEvents" array of a chrome trace into the raw json text of each event
+std::vector<std::string> SplitTraceEvents(const std::string& json) {
+    std::vector<std::string> events;
+    auto p = json.find("\"traceEvents\"");
+    if (std::string::npos == p || std::string::npos == (p = json.find('[', p))) return events;
+    int depth = 0;
+    size_t start = 0;
+    bool in_str = false;
+    for (size_t i = p + 1; i < json.size(); ++i) {
+        char c = json[i];
+        if (in_str) {
+            if ('\\' == c) ++i;
+            else if ('"' == c) in_str = false;
+        } else if ('"' == c) {
+            in_str = true;
+        } else if ('{' == c) {
+            if (0 == depth++) start = i;
+        } else if ('}' == c) {
+            if (0 == --depth) events.push_back(json.substr(start, i - start + 1));
+        } else if (']' == c && 0 == depth) break;
+    }
+    return events;
+}
+//the raw text of a string or number field in json, e.g.: "name":"Source" or "dur":123
+std::string GetJsonField(const std::string& json, const std::string& key) {
+    auto p = json.find("\"" + key + "\":");
+    if (std::string::npos == p) return "";
+    p += key.size() + 3;
+    while (p < json.size() && ' ' == json[p]) ++p;
+    if (p < json.size() && '"' == json[p]) {
+        auto e = p + 1;
+        for (; e < json.size() && '"' != json[e]; ++e) if ('\\' == json[e]) ++e;
+        return json.substr(p + 1, e - p - 1);
+    }
+    auto e = json.find_first_of(",}", p);
+    return json.substr(p, std::string::npos == e ? e : e - p);
+}
+void ZF::ReportTimeTrace(const std::vector<ZFile*>& files) {
+    std::vector<ZObject*> objs;
+    ProcessDepsRecursively(files, [&objs](ZFile* f) {
+        if (FT_OBJ_FILE == f->GetFileType() && !f->HasState(NS_BUILD_FAILED)) objs.push_back((ZObject*)f);
+    });
+    //(category, name) -> (total ms, count)
+    std::map<std::pair<std::string, std::string>, std::pair<double, long>> stats;
+    std::vector<std::string> merged_events;
+    for (size_t tid = 0; tid < objs.size(); ++tid) {
+        auto obj = objs[tid];
+        auto trace_file = GetTimeTraceFile(obj->_file, obj->_compiler);
+        if (!fs::exists(trace_file)) continue;
+        merged_events.push_back(StringPrintf("{\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"name\":\"thread_name\","
+                "\"args\":{\"name\":\"%s\"}}", tid, obj->_src.data()));
+        if (IsClangCompiler(obj->_compiler)) {
+            for (auto& event : SplitTraceEvents(StringFromFile(trace_file))) {
+                auto name = GetJsonField(event, "name");
+                if ("X" != GetJsonField(event, "ph") || StringBeginWith(name, "Total ")) continue;
+                std::string category = "phase";
+                if ("Source" == name) category = "header";
+                else if (StringBeginWith(name, "Instantiate")) category = "template";
+                else if ("CodeGen Function" == name || "OptFunction" == name) category = "codegen";
+                else if ("Frontend" != name && "Backend" != name) continue;
+                auto detail = GetJsonField(event, "detail");
+                auto& stat = stats[{category, "" != detail ? detail : name}];
+                stat.first += atol(GetJsonField(event, "dur").data()) / 1000.0;
+                ++stat.second;
+                //all events of one obj are put into one thread of the merged trace
+                for (auto id : {std::make_pair("\"pid\":", 1ul), std::make_pair("\"tid\":", tid)}) {
+                    auto p = event.find(id.first);
+                    if (std::string::npos == p) continue;
+                    event.replace(p, event.find_first_of(",}", p) - p, StringPrintf("%s%lu", id.first, id.second));
+                }
+                merged_events.push_back(event);
+            }
+            continue;
+        }
+        //gcc: ' phase parsing    :   0.34 ( 57%)   0.20 ( 80%)   0.59 ( 65%)    32M ( 69%)', the
+        //third one is the wall time, and the nested items start with '|'
+        double ts_us = 0;
+        for (const auto& line : StringSplit(StringFromFile(trace_file), '\n')) {
+            auto p = line.find(" : ");
+            if (std::string::npos == p) continue;
+            auto name = StringRightTrim(line.substr(0, p));
+            name = name.substr(std::min(name.find_first_not_of(" |"), name.size()));
+            double usr = 0, sys = 0, wall = 0;
+            if ("TOTAL" == name || 3 != sscanf(line.data() + p + 3, "%lf (%*[^)]) %lf (%*[^)]) %lf",
+                    &usr, &sys, &wall)) continue;
+            bool is_phase = StringBeginWith(name, "phase ");
+            auto category = is_phase ? "phase" : ("template instantiation" == name ? "template" : "pass");
+            auto& stat = stats[{category, name}];
+            stat.first += wall * 1000;
+            ++stat.second;
+            if (!is_phase) continue;
+            merged_events.push_back(StringPrintf("{\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.0f,"
+                    "\"dur\":%.0f,\"name\":\"%s\"}", tid, ts_us, wall * 1e6, name.data()));
+            ts_us += wall * 1e6;
+        }
+    }
+
+    std::vector<std::pair<std::pair<std::string, std::string>, std::pair<double, long>>> sorted_stats(
+            stats.begin(), stats.end());
+    std::sort(sorted_stats.begin(), sorted_stats.end(), [](const auto& a, const auto& b) {
+        return a.second.first > b.second.first;
+    });
+    std::ostringstream oss;
+    oss << "#category\tname\ttotal_ms\tcount" << std::endl;
+    for (auto& x : sorted_stats) {
+        oss << x.first.first << "\t" << x.first.second << "\t" << StringPrintf("%.1f", x.second.first)
+            << "\t" << x.second.second << std::endl;
+    }
+    StringToFile(oss.str(), *AccessBuildRootDir() + "time_trace.tsv");
+    std::string trace = "{\"traceEvents\":[";
+    for (size_t i = 0; i < merged_events.size(); ++i) trace += (i ? ",\n" : "\n") + merged_events[i];
+    StringToFile(trace + "\n]}\n", *AccessBuildRootDir() + "time_trace.json");
+
+    ColorPrint(StringPrintf("* Time trace of %lu obj(s), see the full report '%stime_trace.tsv' and the "
+            "merged trace '%stime_trace.json'\n", objs.size(), AccessBuildRootDir()->data(),
+            AccessBuildRootDir()->data()), CT_BRIGHT_CYAN);
+    for (auto category : {"phase", "header", "template", "codegen", "pass"}) {
+        int n = 0;
+        for (auto& x : sorted_stats) {
+            if (x.first.first != category) continue;
+            if (0 == n) printf("  top %s:\n", category);
+            printf("  %10.1f ms %6ld  %s\n", x.second.first, x.second.second, x.first.second.data());
+            if (++n >= 10) break;
+        }
+    }
+}
+
+//scan the preamble of a C++ source for the module it provides and the modules or header units it
+//imports; the scan stops at the first line which can't be in the preamble, e.g.:
+//  module;                    //the global module fragment, only preprocessor directives follow it
+//  #include <stdio.h>
+//  export module a;           //provides "a"; 'module a;' is an implementation unit importing "a"
+//  export import :part;       //imports "a:part"
+//  import <vector>;           //imports the header unit "<vector>"
+void ScanModuleDeps(const std::string& src, std::string* module, std::vector<std::string>* imports) {
+    std::ifstream ifs(src);
+    std::string line;
+    bool in_comment = false;
+    while (std::getline(ifs, line)) {
+        //strip the comments
+        std::string code;
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (in_comment) {
+                if ('*' == line[i] && i + 1 < line.size() && '/' == line[i + 1]) in_comment = false, ++i;
+            } else if ('/' == line[i] && i + 1 < line.size() && '*' == line[i + 1]) {
+                in_comment = true, ++i;
+            } else if ('/' == line[i] && i + 1 < line.size() && '/' == line[i + 1]) {
+                break;
+            } else code += line[i];
+        }
+        code = StringRightTrim(code.substr(std::min(code.find_first_not_of(" \t"), code.size())));
+        if ("" == code || '#' == code.at(0) || "module;" == code) continue;
+        bool exported = StringBeginWith(code, "export ");
+        if (exported) code = code.substr(code.find_first_not_of(' ', 7));
+        auto name_fn = [&code](size_t pos) {
+            auto name = code.substr(pos, code.find(';') - pos);
+            name.erase(std::remove_if(name.begin(), name.end(), isspace), name.end());
+            return name;
+        };
+        if (StringBeginWith(code, "module ")) {
+            auto name = name_fn(7);
+            if (":private" == name) break;
+            //an implementation unit implicitly imports the primary interface of its module
+            if (!exported && std::string::npos == name.find(':')) imports->push_back(name);
+            else *module = name;
+        } else if (StringBeginWith(code, "import ") || StringBeginWith(code, "import<") ||
+                StringBeginWith(code, "import\"")) {
+            auto name = name_fn(6);
+            if ("" == name) continue;
+            if (':' == name.at(0)) name = module->substr(0, module->find(':')) + name;
+            imports->push_back(name);
+        } else break;
+    }
+}
+//the search dirs of '#include <...>' used by the compiler
+const std::vector<std::string>& GetSystemIncludeDirs(const std::string& compiler) {
+    static std::map<std::string, std::vector<std::string>> s_dirs;
+    auto iter = s_dirs.find(compiler);
+    if (s_dirs.end() != iter) return iter->second;
+    auto& dirs = s_dirs[compiler];
+    bool in_list = false;
+    for (const auto& line : StringSplit(ExecuteCmd("echo | " + compiler + " -xc++ -E -v - 2>&1"), '\n')) {
+        if (StringBeginWith(line, "#include <...> search starts here:")) in_list = true;
+        else if (StringBeginWith(line, "End of search list.")) break;
+        else if (in_list) dirs.push_back(fs::path(line.substr(1)).lexically_normal());
+    }
+    return dirs;
+}
+std::string GetModuleCmiFile(const std::string& name, const std::string& compiler) {
+    auto suffix = IsClangCompiler(compiler) ? ".pcm" : ".gcm";
+    //the header unit is named by its path, e.g.: '/usr/include/c++/12/vector'
+    if ('/' == name.at(0)) return *AccessBuildRootDir() + ".modules/hu" + name + suffix;
+    return *AccessBuildRootDir() + ".modules/" + StringReplaceAll(name, ":", "-") + suffix;
+}
+void ZF::ApplyModules() {
+    std::set<ZObject*> objs;
+    for (auto& x : GlobalFiles()) {
+        if (!x.second || FT_OBJ_FILE != x.second->GetFileType() || "" != x.second->_cmd) continue;
+        auto obj = (ZObject*)x.second;
+        if (!objs.insert(obj).second || !fs::exists(obj->_src)) continue;
+        obj->_module.clear();
+        obj->_imports.clear();
+        ScanModuleDeps(obj->_src, &obj->_module, &obj->_imports);
+    }
+    //module name -> the obj providing it and its CMI file
+    using T = std::map<std::string, std::pair<ZObject*, ZFile*>>;
+    auto& modules = GlobalResource<T, GRT_MODULE>::Resource();
+    for (auto obj : objs) {
+        if ("" == obj->_module) continue;
+        auto& m = modules[obj->_module];
+        if (m.first && m.first != obj) {
+            ZTHROW("the module '%s' is provided by both '%s' and '%s'", obj->_module.data(),
+                    m.first->_src.data(), obj->_src.data());
+        }
+        if (m.first) continue;
+        auto cmi = AccessFile(GetModuleCmiFile(obj->_module, obj->_compiler), true, FT_NORMAL_FILE);
+        UpdateGeneratedByDep(cmi, true);
+        cmi->AddDep(obj);
+        m = {obj, cmi};
+    }
+    //header unit path -> its CMI file, which is built by its own cmd
+    std::map<std::string, ZFile*> header_units;
+    auto header_unit_fn = [&](ZObject* obj, const std::string& import) -> std::string {
+        auto header = import.substr(1, import.size() - 2);
+        std::vector<std::string> dirs;
+        if ('"' == import.at(0)) {
+            dirs = {GetDirnameFromPath(obj->_src)};
+            dirs.insert(dirs.end(), obj->_inc_dirs.begin(), obj->_inc_dirs.end());
+        }
+        for (const auto& dir : GetSystemIncludeDirs(obj->_compiler)) dirs.push_back(dir);
+        std::string path;
+        for (const auto& dir : dirs) {
+            path = (fs::path(dir) / header).lexically_normal();
+            if (fs::exists(path)) break;
+            path = "";
+        }
+        if ("" == path) ZTHROW("can't find the header unit %s imported by '%s'", import.data(), obj->_src.data());
+        if (header_units.count(path)) return path;
+        auto cmi_file = GetModuleCmiFile(path, obj->_compiler);
+        auto hu = AccessFile(cmi_file, true, FT_NORMAL_FILE);
+        hu->_name = import;
+        auto conf = " " + DefaultObjectConfig()->ToString();
+        if (IsClangCompiler(obj->_compiler)) {
+            hu->_cmd = StringPrintf("%s%s --precompile -xc++-%s-header %s -o %s", obj->_compiler.data(),
+                    conf.data(), '"' == import.at(0) ? "user" : "system",
+                    ('"' == import.at(0) ? path : header).data(), cmi_file.data());
+        } else {
+            hu->_rsp_files = {{cmi_file + ".modmap", path + " " + cmi_file + "\n"}};
+            hu->_cmd = StringPrintf("%s%s -fmodules-ts -fmodule-mapper=%s.modmap -x c++-%s %s -c",
+                    obj->_compiler.data(), conf.data(), cmi_file.data(),
+                    '"' == import.at(0) ? "header" : "system-header",
+                    ('"' == import.at(0) ? path : header).data());
+        }
+        if ('"' == import.at(0)) hu->AddDep(AccessFile(path));
+        header_units[path] = hu;
+        return path;
+    };
+    //the CMI files of all the modules imported directly or indirectly are needed by the compiler
+    std::function<void(ZObject*, std::map<std::string, std::string>*)> fill_map_fn;
+    fill_map_fn = [&](ZObject* obj, std::map<std::string, std::string>* module_map) {
+        for (const auto& import : obj->_imports) {
+            if ('<' == import.at(0) || '"' == import.at(0)) {
+                auto path = header_unit_fn(obj, import);
+                (*module_map)[path] = header_units[path]->_file;
+                continue;
+            }
+            auto iter = modules.find(import);
+            if (modules.end() == iter) {
+                ZTHROW("the module '%s' imported by '%s' isn't provided by any source", import.data(),
+                        obj->_src.data());
+            }
+            if (module_map->count(import)) continue;
+            (*module_map)[import] = iter->second.second->_file;
+            fill_map_fn(iter->second.first, module_map);
+        }
+    };
+    for (auto obj : objs) {
+        obj->_module_map.clear();
+        if ("" != obj->_module) obj->_module_map[obj->_module] = modules[obj->_module].second->_file;
+        fill_map_fn(obj, &obj->_module_map);
+        //only the direct imports are needed to schedule, the indirect ones are the deps of them
+        for (const auto& import : obj->_imports) {
+            if ('<' == import.at(0) || '"' == import.at(0)) obj->AddDep(header_units[header_unit_fn(obj, import)]);
+            else obj->AddDep(modules[import].second);
+        }
+    }
+}
+
+void ZF::ApplyVariants(std::vector<ZFile*>* targets) {
+    if (AccessBuildVariants()->empty()) return;
+    std::vector<ZFile*> variant_targets;
+    std::set<ZFile*> uniq_targets;
+    for (const auto& name : *AccessBuildVariants()) {
+        auto variant = AccessVariant(name);
+        if (variant->GetCompileConfig().Empty() && variant->GetLinkConfig().Empty()) {
+            ZTHROW("unknown build variant(%s)", name.data());
+        }
+        std::map<ZFile*, ZFile*> clones;
+        for (auto f : *targets) {
+            auto clone = CloneForVariant(f, name, &clones, true);
+            if (uniq_targets.insert(clone).second) variant_targets.push_back(clone);
+        }
+        for (auto& x : clones) if (x.first != x.second) x.second->_variant = variant;
+    }
+    *targets = variant_targets;
+}
+
+//for each binary with PGO enabled, build its instrumented variant, run the training cmd to collect
+//the profile, and link it with the objs optimized by the profile
+void ZF::ApplyPGO() {
+    std::set<ZBinary*> bins;
+    for (auto& x : GlobalFiles()) {
+        if (!x.second || FT_BINARY_FILE != x.second->GetFileType()) continue;
+        auto bin = (ZBinary*)x.second;
+        if ("" != bin->_pgo_training_cmd && !bin->HasState(NS_BUILD_DONE)) bins.insert(bin);
+    }
+    const auto& build_root = *AccessBuildRootDir();
+    for (auto bin : bins) {
+        auto variant = "pgo" + StringReplaceAll(bin->_name, "/", "-");
+        auto gen_root = build_root + ".variants/" + variant + "/gen/";
+        auto use_root = build_root + ".variants/" + variant + "/use/";
+        bool is_clang = IsClangCompiler(bin->_compiler);
+
+        std::map<ZFile*, ZFile*> gen_clones;
+        auto gen_bin = (ZBinary*)CloneForVariant(bin, variant + "/gen", &gen_clones);
+        gen_bin->_pgo_training_cmd = "";
+        for (auto& x : gen_clones) {
+            if (x.first == x.second || FT_LIB_FILE == x.second->GetFileType()) continue;
+            if (is_clang) x.second->SetFlag("-fprofile-instr-generate");
+            else x.second->SetFlags({"-fprofile-generate", "-fprofile-update=atomic"});
+        }
+
+        //the profile is regenerated by training once the instrumented binary is rebuilt
+        auto training_cmd = ZGenerator(bin->_pgo_training_cmd).Generate({gen_bin->_file});
+        std::string profile_file, cmd, use_flag;
+        if (is_clang) {
+            profile_file = gen_root + "default.profdata";
+            auto raw_dir = gen_root + ".profraw";
+            cmd = StringPrintf("rm -rf %s && export LLVM_PROFILE_FILE=%s/%%p.profraw && %s && "
+                    "llvm-profdata merge -output=%s %s/*.profraw", raw_dir.data(), raw_dir.data(),
+                    training_cmd.data(), profile_file.data(), raw_dir.data());
+            use_flag = "-fprofile-instr-use=" + profile_file;
+        } else {
+            //'.gcda' files are written next to the instrumented objs, and gcc looks for them next to
+            //the optimized objs, so copy them; the profile file records their md5s
+            profile_file = gen_root + "gcda.md5s";
+            cmd = StringPrintf("find %s -name '*.gcda' -delete && %s && cd %s && "
+                    "find . -name '*.gcda' | xargs -r cp --parents -t %s && "
+                    "find . -name '*.gcda' | sort | xargs -r md5sum > %s", gen_root.data(),
+                    training_cmd.data(), gen_root.data(), use_root.data(), profile_file.data());
+            use_flag = "-fprofile-use";
+        }
+        auto profile = Create<ZFile>(profile_file, FT_NORMAL_FILE, true);
+        profile->_name = bin->_name + "(pgo training)";
+        profile->_cmd = cmd;
+        profile->_cwd = bin->_cwd;
+        profile->AddDep(gen_bin);
+        GlobalFiles()[profile_file] = profile;
+        GlobalOpaqueFiles().insert(profile);
+
+        std::map<ZFile*, ZFile*> use_clones = {{bin, bin}};
+        RemapVariantDeps(bin, variant + "/use", &use_clones);
+        bin->SetFlag(use_flag);
+        for (auto& x : use_clones) {
+            if (x.first == x.second || FT_OBJ_FILE != x.second->GetFileType()) continue;
+            x.second->SetFlag(use_flag);
+            //the code which isn't run by training has no profile, it's normal
+            if (!is_clang) x.second->SetFlags({"-fprofile-correction", "-Wno-missing-profile"});
+            x.second->AddDep(profile);
+        }
+    }
+}
+
+//for each binary with layout optimization enabled, profile it by the workload under `perf record`,
+//then optimize it by BOLT, or relink it with the hot functions ordered by the profile
+void ZF::ApplyLayoutOptimization() {
+    std::set<ZBinary*> bins;
+    for (auto& x : GlobalFiles()) {
+        if (!x.second || FT_BINARY_FILE != x.second->GetFileType()) continue;
+        auto bin = (ZBinary*)x.second;
+        if ("" != bin->_layout_profiling_cmd && !bin->HasState(NS_BUILD_DONE)) bins.insert(bin);
+    }
+    const auto& build_root = *AccessBuildRootDir();
+    for (auto bin : bins) {
+        auto variant = "layout" + StringReplaceAll(bin->_name, "/", "-");
+        auto work_dir = build_root + ".variants/" + variant + "/";
+        if (!*AccessExplainMode()) fs::create_directories(work_dir);
+        auto perf_data = work_dir + "perf.data";
+        auto profiling_cmd = ZGenerator(bin->_layout_profiling_cmd).Generate({bin->_file});
+        auto layout_file = bin->_file + ".layout";
+
+        if (ExistsInPath("llvm-bolt") && ExistsInPath("perf2bolt")) {
+            //BOLT needs the relocations kept in the binary
+            bin->SetFlag("-Wl,--emit-relocs");
+            auto fdata = work_dir + "perf.fdata";
+            auto layout = Create<ZFile>(layout_file, FT_NORMAL_FILE, true);
+            layout->_name = bin->_name + "(bolt)";
+            layout->_cmd = StringPrintf("perf record -e cycles:u -j any,u -o %s -- %s && "
+                    "perf2bolt -p %s -o %s %s && llvm-bolt %s -o %s -data=%s -reorder-blocks=ext-tsp "
+                    "-reorder-functions=hfsort -split-functions -split-all-cold -dyno-stats",
+                    perf_data.data(), profiling_cmd.data(), perf_data.data(), fdata.data(),
+                    bin->_file.data(), bin->_file.data(), layout_file.data(), fdata.data());
+            layout->_cwd = bin->_cwd;
+            layout->AddDep(bin);
+            GlobalFiles()[layout_file] = layout;
+            continue;
+        }
+
+        //lld and mold order the functions by symbol names, while gold orders the sections, so every
+        //function should be put into its own section
+        const auto& linker = GetFastLinker();
+        auto order_file = work_dir + "symbol_order.txt";
+        std::vector<std::string> ordering_flags;
+        if ("lld" == linker || "mold" == linker) {
+            ordering_flags = {"-fuse-ld=" + linker, "-Wl,--symbol-ordering-file=" + order_file};
+        } else if ("gold" == linker) {
+            ordering_flags = {"-fuse-ld=gold", "-Wl,--section-ordering-file=" + order_file};
+        } else {
+            fprintf(stderr, "[Warn]neither BOLT nor a linker supporting symbol ordering is found, "
+                    "skip the layout optimization of '%s'\n", bin->_file.data());
+            continue;
+        }
+
+        //the hot functions are sorted by their samples
+        auto order = Create<ZFile>(order_file, FT_NORMAL_FILE, true);
+        order->_name = bin->_name + "(symbol ordering)";
+        order->_cmd = StringPrintf("perf record -e cycles:u -o %s -- %s && perf report -i %s --stdio "
+                "--no-children --no-demangle --sort symbol -g none 2>/dev/null | awk '/\\[\\.\\]/ "
+                "&& !seen[$NF]++ {print \"%s\" $NF}' > %s", perf_data.data(), profiling_cmd.data(),
+                perf_data.data(), "gold" == linker ? ".text." : "", order_file.data());
+        order->_cwd = bin->_cwd;
+        order->AddDep(bin);
+        GlobalFiles()[order_file] = order;
+        GlobalOpaqueFiles().insert(order);
+
+        //the relinked binary is linked from the clones of its objs and internal static libs, which are
+        //compiled with every function in its own section, so the original objs are left untouched
+        auto layout = Duplicate(bin, layout_file);
+        layout->_layout_profiling_cmd = "";
+        std::map<ZFile*, ZFile*> clones = {{bin, layout}};
+        RemapVariantDeps(layout, variant, &clones);
+        for (auto& x : clones) {
+            if (x.first != x.second && FT_OBJ_FILE == x.second->GetFileType()) {
+                x.second->SetFlag("-ffunction-sections");
+            }
+        }
+        layout->SetFlags(ordering_flags);
+        layout->AddDep(order);
+        GlobalFiles()[layout_file] = layout;
+    }
+}
+
+LtoMode ZBinary::GetLtoMode() const {
+    return _lto_mode < 0 ? *AccessLtoMode() : (LtoMode)_lto_mode;
+}
+std::string ZBinary::ComposeExecCommand(bool cmd_changed) {
+    return ComposeLtoExecCommand(GetLtoMode());
+}
+
 ZBinary::ZBinary(const std::string& bin_name): ZFile("", FT_BINARY_FILE, true) {
     _name = bin_name;
     _file = GetBuildPath(bin_name);
@@ -1080,36 +3031,38 @@ const std::vector<std::string>& ZBinary::GetLinkDirs() const {
 bool ZBinary::ComposeCommand() {
     if ("" == _cmd) {
         _cmd = StringPrintf("%s -o %s", _compiler.data(), _file.data());
+        _rsp_files.clear();
+        std::string args;
         for (auto obj : _objs) {
-            _cmd += StringPrintf(" %s", obj->GetFilePath().data());
+            args += StringPrintf(" %s", obj->GetFilePath().data());
         }
 
         //TODO move flags like '-lpthread' to the end of _cmd
-        std::set<ZFile*> uniq_deps;
+        std::set<ZFile*> uniq_deps = GlobalOpaqueFiles();
         uniq_deps.insert(_whole_archive_libs.begin(), _whole_archive_libs.end());
         if (!_whole_archive_libs.empty()) {
-            _cmd += " -Wl,--whole-archive";
+            args += " -Wl,--whole-archive";
             for (auto lib : _whole_archive_libs) {
                 GetConfig()->Merge(lib->GetLinkConfig());
-                _cmd += StringPrintf(" %s", lib->GetFilePath().data());
+                args += StringPrintf(" %s", lib->GetFilePath().data());
             }
-            _cmd += " -Wl,--no-whole-archive";
+            args += " -Wl,--no-whole-archive";
         }
 
-        for (const auto& dir : _link_dirs) _cmd += StringPrintf(" -L%s", dir.data());
+        for (const auto& dir : _link_dirs) args += StringPrintf(" -L%s", dir.data());
 
         auto adjust_cmd_fn = [&](ZLibrary* lib) {
             GetConfig()->Merge(lib->GetLinkConfig());
             if (lib->IsStaticLibrary()) {
                 if (lib->IsUsedAsWholeArchive()) {
-                    _cmd += " -Wl,--whole-archive";
-                    _cmd += StringPrintf(" %s", lib->GetFilePath().data());
-                    _cmd += " -Wl,--no-whole-archive";
+                    args += " -Wl,--whole-archive";
+                    args += StringPrintf(" %s", lib->GetFilePath().data());
+                    args += " -Wl,--no-whole-archive";
                 } else {
-                    _cmd += StringPrintf(" %s", lib->GetFilePath().data());
+                    args += StringPrintf(" %s", lib->GetFilePath().data());
                 }
             } else {
-                _cmd += StringPrintf(" -L%s -l%s", lib->GetLinkDir().data(), lib->GetLinkLib().data());
+                args += StringPrintf(" -L%s -l%s", lib->GetLinkDir().data(), lib->GetLinkLib().data());
             }
         };
 
@@ -1138,16 +3091,22 @@ bool ZBinary::ComposeCommand() {
         }
         for (auto iter = pkgs.rbegin(); pkgs.rend() != iter; ++iter) {
             auto& libs = external_libs[*iter];
-            if (libs.size() > 1) _cmd += " -Wl,\"-(\"";
+            if (libs.size() > 1) args += " -Wl,\"-(\"";
             for (auto lib : libs) adjust_cmd_fn(lib);
-            if (libs.size() > 1) _cmd += " -Wl,\"-)\"";
+            if (libs.size() > 1) args += " -Wl,\"-)\"";
         }
 
+        std::string conf_args;
         if (_conf) {
-            _cmd += " " + _conf->ToString(DefaultBinaryConfig());
+            conf_args = " " + _conf->ToString(DefaultBinaryConfig());
         } else {
-            _cmd += " " + DefaultBinaryConfig()->ToString();
+            conf_args = " " + DefaultBinaryConfig()->ToString();
         }
+        conf_args += GetFastLinkLinkFlags();
+        conf_args += GetLtoLinkFlags(GetLtoMode(), _compiler, conf_args);
+        _cmd += UseResponseFileIfNeeded(args, _cmd.size() + conf_args.size(), _file + ".rsp", &_rsp_files);
+        _cmd += conf_args;
+        if (_variant) ApplyVariantFlags(_cmd, _variant->GetLinkConfig());
     }
     UpdateOptimizationLevel(_cmd);
     return true;
@@ -1165,18 +3124,23 @@ ZObject* ZProto::SpawnObj() {
     //the locations of all generated *.pb.h are based on ${BUILD_ROOT_DIR}
     obj->AddIncludeDir(*AccessBuildRootDir());
 
-    ProcessDepsRecursively(obj->GetDeps(), [&](ZFile* f) {
-        //handle AccessProto("ps.proto")->AddDep(AccessProto("base.proto"))
-        if (FT_PROTO_FILE == f->GetFileType() && this != f) {
-            //using 'XXX.pb.cc' instead of 'XXX.pb.h' to trigger its generation through `protoc`
-            //is used to save the opportunity for first invoking AccessFile('XXX.pb.h') so that
-            //the 'CWD' can switch to the correct directory where 'XXX.pb.h' belongs.
-            auto pb_src_file = AccessFile(GetBuildPath(StringReplaceSuffix(
-                    f->GetFilePath(), ".proto", ".pb.cc")));
-            obj->AddDep(pb_src_file);
-            obj->AddIncludeDir(GetBuildPath(pb_src_file->GetCwd()));
-        }
+    //handle AccessProto("ps.proto")->AddDep(AccessProto("base.proto")); only the deps of this proto
+    //are walked, rather than the ones of 'obj' which might be loaded from its '.d' file, otherwise the
+    //include dirs(and the cmd) would differ between the first build and the later ones, and the
+    //imports found by parsing are handled by ZF::ApplyProtoImports in the import order
+    std::vector<ZFile*> dep_protos;
+    ProcessDepsRecursively(GetDeps(), [&](ZFile* f) {
+        if (FT_PROTO_FILE == f->GetFileType() && this != f) dep_protos.push_back(f);
     });
+    for (auto f : dep_protos) {
+        //using 'XXX.pb.cc' instead of 'XXX.pb.h' to trigger its generation through `protoc`
+        //is used to save the opportunity for first invoking AccessFile('XXX.pb.h') so that
+        //the 'CWD' can switch to the correct directory where 'XXX.pb.h' belongs.
+        auto pb_src_file = AccessFile(GetBuildPath(StringReplaceSuffix(
+                f->GetFilePath(), ".proto", ".pb.cc")));
+        obj->AddDep(pb_src_file);
+        obj->AddIncludeDir(GetBuildPath(pb_src_file->GetCwd()));
+    }
     return obj;
 }
 
@@ -1192,6 +3156,7 @@ ZProto::ZProto(const std::string& proto_file): ZFile(proto_file, FT_PROTO_FILE,
     auto src_file = AccessFile(src_path, true, FT_SOURCE_FILE);
     ZF::UpdateGeneratedByDep(src_file, true);
     src_file->AddDep(this);
+    _gen_files = {hdr_file->GetFilePath(), src_file->GetFilePath()};
 }
 bool ZProto::ComposeCommand() {
     if ("" == _cmd) {
@@ -1215,15 +3180,189 @@ bool ZProto::ComposeCommand() {
     }
     return true;
 }
+std::string ZProto::ComposeExecCommand(bool cmd_changed) {
+    return ZF::ComposeStagedExecCommand(this);
+}
 void ZProto::AddProtoImportDir(const std::string& dir) {
     _proto_import_dirs.push_back(dir);
 }
 
+//the imports parsed from each proto, which are recorded in 'BUILD.proto_imports' with the md5 of the
+//proto, so a proto is parsed again only if its content has been changed
+struct ProtoImports {
+    struct Entry {
+        std::string md5;
+        std::vector<std::string> imports;
+    };
+    static std::map<std::string, Entry>& GetAll() {
+        using T = std::map<std::string, Entry>;
+        GlobalResource<T, GRT_PROTO_IMPORT>::InitOnce([](T& proto_imports) {
+            for (auto& line : StringSplit(StringFromFile(GetCacheFile()), '\n')) {
+                const auto& infos = StringSplit(line, ' ');
+                if (infos.size() < 2) continue;
+                auto& entry = proto_imports[infos[0]];
+                entry.md5 = infos[1];
+                if (infos.size() > 2) entry.imports = StringSplit(infos[2], ';');
+            }
+        });
+        return GlobalResource<T, GRT_PROTO_IMPORT>::Resource();
+    }
+    static const std::vector<std::string>& Get(const std::string& proto, bool* updated) {
+        auto& entry = GetAll()[proto];
+        auto md5 = Md5Cache::Get(proto).substr(1);
+        if (md5 == entry.md5) return entry.imports;
+        entry.md5 = md5;
+        entry.imports.clear();
+        //e.g.: import "a/b.proto"; import public "c.proto"; import weak "d.proto";
+        for (const auto& line : StringSplit(StringFromFile(proto), '\n')) {
+            auto p = line.find_first_not_of(" \t");
+            if (std::string::npos == p || 0 != line.compare(p, 6, "import")) continue;
+            auto begin = line.find('"', p + 6);
+            auto end = (std::string::npos == begin) ? begin : line.find('"', begin + 1);
+            if (std::string::npos != end) entry.imports.push_back(line.substr(begin + 1, end - begin - 1));
+        }
+        *updated = true;
+        return entry.imports;
+    }
+    static void Save() {
+        std::ostringstream oss;
+        for (auto& x : GetAll()) {
+            oss << x.first << " " << x.second.md5;
+            if (!x.second.imports.empty()) oss << " " << StringCompose(x.second.imports, ';');
+            oss << std::endl;
+        }
+        StringToFile(oss.str(), GetCacheFile());
+    }
+
+private:
+    static std::string GetCacheFile() { return *AccessBuildRootDir() + "BUILD.proto_imports"; }
+};
+
+void ZF::ApplyProtoImports() {
+    std::set<ZProto*> protos;
+    for (auto& x : GlobalFiles()) {
+        if (auto proto = dynamic_cast<ZProto*>(x.second)) protos.insert(proto);
+    }
+    bool updated = false;
+    for (auto proto : protos) {
+        if (!fs::exists(proto->_file)) continue;
+        ExternalProjectGuard guard(proto->_ext_prj);
+        //the import paths are resolved in the same order as the '-I' flags of ZProto::ComposeCommand
+        std::vector<std::string> import_dirs = {*AccessProjectRootDir(), proto->_cwd};
+        import_dirs.insert(import_dirs.end(), proto->_proto_import_dirs.begin(), proto->_proto_import_dirs.end());
+        auto pb_file_fn = [](ZFile* p, const std::string& suffix) {
+            return GetBuildPath(StringReplaceSuffix(p->_file, ".proto", suffix));
+        };
+        auto obj = dynamic_cast<ZObject*>(AccessFileInternal(pb_file_fn(proto, ".pb.o")));
+        for (const auto& import : ProtoImports::Get(proto->_file, &updated)) {
+            //the imported protos which aren't defined in this project(e.g.: google/protobuf/*.proto)
+            //are skipped
+            ZProto* imported = nullptr;
+            for (const auto& dir : import_dirs) {
+                auto f = AccessFileInternal(fs::path(dir + "/" + import).lexically_normal());
+                if ((imported = dynamic_cast<ZProto*>(f))) break;
+            }
+            if (!imported || imported == proto) continue;
+            proto->AddDep(imported);
+            AccessFile(pb_file_fn(proto, ".pb.h"))->AddDep(AccessFile(pb_file_fn(imported, ".pb.h")));
+            //the same as ZProto::SpawnObj, use 'XXX.pb.cc' to trigger the generation of 'XXX.pb.h'
+            if (obj) {
+                auto pb_src_file = AccessFile(pb_file_fn(imported, ".pb.cc"));
+                obj->AddDep(pb_src_file);
+                obj->AddIncludeDir(GetBuildPath(pb_src_file->GetCwd()));
+            }
+        }
+    }
+    if (updated && !*AccessExplainMode()) ProtoImports::Save();
+}
+
+void ZF::ApplyProtoBatches(const std::vector<ZFile*>& files) {
+    //nothing is executed in explain mode
+    if (*AccessExplainMode()) return;
+    std::vector<ZFile*> protos;
+    ProcessDepsRecursively(files, [&](ZFile* f) {
+        if (!dynamic_cast<ZProto*>(f) || f->HasState(NS_BUILD_DONE)) return;
+        ExternalProjectGuard guard(f->_ext_prj);
+        if (!f->ComposeCommand()) return;
+        //the cmd customized by SetFullCommand can't be batched
+        if (!f->_rsp_files.empty() || !StringEndWith(f->_cmd, " " + f->_file)) return;
+        f->SetState(NS_BATCHED);
+        protos.push_back(f);
+    });
+    if (protos.empty()) return;
+
+    //the up-to-date checks are still done for each proto, and the out-of-date ones are grouped by
+    //the cmd without the proto file, i.e.: the compiler, the output dir and the import dirs
+    std::map<std::string, std::vector<ZFile*>> groups;
+    for (auto p : protos) p->Build();
+    for (auto p : protos) {
+        p->SetState(NS_BATCHED, false);
+        if (!p->HasState(NS_HAS_BEEN_BUILT) || p->HasState(NS_BUILD_FAILED)) continue;
+        groups[p->_cmd.substr(0, p->_cmd.size() - p->_file.size() - 1)].push_back(p);
+    }
+
+    //split each group into chunks to make use of the '-j' slots, but a chunk shouldn't be too small,
+    //otherwise the shared imports are parsed again and again
+    constexpr size_t kMinChunkSize = 16, kMaxChunkSize = 128;
+    std::vector<ZFile*> batches;
+    std::map<ZFile*, std::vector<ZFile*>> batch_protos;
+    for (auto& x : groups) {
+        auto& ps = x.second;
+        size_t chunk_size = (ps.size() + JobSlots::GetTotal() - 1) / JobSlots::GetTotal();
+        chunk_size = std::min(std::max(chunk_size, kMinChunkSize), kMaxChunkSize);
+        for (size_t i = 0; i < ps.size(); i += chunk_size) {
+            std::vector<ZFile*> chunk(ps.begin() + i, ps.begin() + std::min(i + chunk_size, ps.size()));
+            //the protos with the same cmd prefix always belong to the same project
+            ExternalProjectGuard guard(chunk[0]->_ext_prj);
+            auto batch = ZF::Create<ZFile>(chunk[0]->_file, FT_PROTO_FILE, false);
+            batch->_name = (1 == chunk.size()) ? chunk[0]->_name :
+                    StringPrintf("batch of %lu protos", chunk.size());
+            batch->_cwd = chunk[0]->_cwd;
+            batch->_ext_prj = chunk[0]->_ext_prj;
+            batch->_cmd = x.first;
+            for (auto p : chunk) {
+                batch->_cmd += " " + p->_file;
+                batch->_gen_files.insert(batch->_gen_files.end(), p->_gen_files.begin(), p->_gen_files.end());
+                //the same as ZFile::Build, '.cmd' is only recorded after the build succeeds
+                std::error_code ec;
+                fs::remove(GetBuildPath(p->_file) + ".cmd", ec);
+            }
+            batch->_exec_cmd = ComposeStagedExecCommand(batch);
+            batch_protos[batch] = std::move(chunk);
+            batches.push_back(batch);
+        }
+    }
+
+    //the concurrency is limited by the '-j' slots acquired in ExecuteBuild
+    std::vector<std::thread> threads;
+    for (auto batch : batches) {
+        threads.emplace_back([batch, &batch_protos]() {
+            const auto& chunk = batch_protos.at(batch);
+            ExternalProjectGuard guard(batch->_ext_prj);
+            bool ok = ExecuteBuild(batch);
+            if (ok) CommitStagedFiles(batch);
+            long ms = ok ? BuildTimes::Get(batch->_file) : -1;
+            for (auto p : chunk) {
+                if (!ok) {
+                    p->SetState(NS_BUILD_FAILED);
+                    continue;
+                }
+                StringToFile(GetCommandSignature(p->_cmd, p->_rsp_files) + "\n" + p->_cmd,
+                        GetBuildPath(p->_file) + ".cmd");
+                for (const auto& f : p->_gen_files) AcquireFileMTime(f, true);
+                //the cost of each proto is estimated by the average one
+                BuildTimes::Record(p->_file, ms / (long)chunk.size());
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+}
+
 ZObject* AccessObject(const std::string& src_file, const std::string& obj_file) {
     std::string new_obj_file = obj_file;
     if ("" != new_obj_file) new_obj_file = ConvertToProjectInnerPath(new_obj_file);
     std::string p_obj = ("" != new_obj_file) ? GetBuildPath(new_obj_file) :
-            GetBuildPath(StringReplaceSuffix(src_file, C_CPP_SOURCE_SUFFIXES, ".o"));
+            GetBuildPath(ReplaceSourceSuffix(src_file, ".o"));
 
     auto*& f = AccessFileInternal(p_obj);
     if (!f) f = (ZF::Create<ZObject>(src_file, new_obj_file))->AddDep(AccessFile(src_file));
@@ -1248,13 +3387,13 @@ ZLibrary* AccessLibrary(const std::string& lib_name, bool is_static_lib) {
     else {
         if (FT_LIB_FILE != f->GetFileType()) ZTHROW("'%s' is not an ZLibrary instance", FP(f));
         //correct the library's cwd
-        if (fs::current_path() != f->GetCwd()) {
+        if (GetCurrentDir() != f->GetCwd()) {
             ZLibrary* lib = (ZLibrary*)f;
             if (std::string::npos == lib_name.find('/')) {
-                ZF::UpdateCwd(lib, fs::current_path());
+                ZF::UpdateCwd(lib, GetCurrentDir());
             } else {
                 auto old_cwd = f->GetCwd();
-                auto new_cwd = fs::current_path();
+                auto new_cwd = GetCurrentDir();
                 auto p = fs::path(f->GetFilePath());
                 auto rel_oc = p.lexically_relative(old_cwd);
                 auto rel_nc = p.lexically_relative(new_cwd);
@@ -1326,55 +3465,142 @@ std::vector<ZLibrary*> ImportLibraries(const std::string& pkg_name, const std::s
     }
     return result;
 }
+std::string* AccessPackageStoreDir() {
+    static std::string s_store_dir = []() -> std::string {
+        if (auto dir = getenv("ZMAKE_PACKAGE_STORE")) return dir;
+        return std::string(getenv("HOME") ? getenv("HOME") : "/tmp") + "/.zmake/packages/";
+    }();
+    return &s_store_dir;
+}
+std::string* AccessPackageMirrorDir() {
+    static std::string s_mirror_dir;
+    return &s_mirror_dir;
+}
+//the md5 of the default C/C++ compilers and their versions, since the packages built by different
+//toolchains might be incompatible
+std::string GetToolchainFingerprint() {
+    static std::string s_fingerprint = []() {
+        std::string info;
+        for (auto suffix : {".c", ".cpp"}) {
+            auto compiler = *AccessDefaultCompiler(suffix);
+            info += compiler + "\n" + ExecuteCmd(compiler + " --version 2>&1") + "\n";
+        }
+        return StringMd5(info);
+    }();
+    return s_fingerprint;
+}
 std::vector<ZLibrary*> DownloadLibraries(const std::string& pkg_name,
         const std::string& url, const std::string& compile_cmd, bool header_lib) {
     if ('@' == pkg_name.at(0)) {
         return DownloadLibraries(pkg_name.substr(1), url, compile_cmd, header_lib);
     }
-    auto pkg_dir = *AccessBuildRootDir() + ".downloads/" + pkg_name;
-    if (!fs::exists(pkg_dir + "/.done")) fs::remove_all(pkg_dir);
-    else {
-        if (!header_lib) return ImportLibraries(pkg_name, pkg_dir);
-        else {
-            auto lib = ImportLibrary(pkg_name, {pkg_dir + "/include"}, "");
-            if (!lib) ZTHROW("found .done file, but import '%s' header lib from '%s' failed",
-                    pkg_name.data(), pkg_dir.data());
-            return {lib};
-        }
-    }
-    auto cmd = StringPrintf("mkdir -p %s\n"
-            "cd %s\n"
-            "wget -q \"%s\"\n"
-            "f=$(ls)\n"
-            "tar zxf $f --no-same-owner || unzip $f\n"
-            "rm -f $f\n"
-            "f=$(ls)\n"
-            "cd $f\n"
-            "%s #compile cmd\n"
-            "[ \"$?\" -ne 0 ] && exit $?\n"
-            "cd ..\n"
-            "rm -rf $f && touch .done", pkg_dir.data(), pkg_dir.data(),
-            url.data(), "" != compile_cmd ? compile_cmd.data() :
-                    "./configure --prefix=$(readlink -f ..) && make -j2 && make install");
-    if (*AccessDebugLevel() > 0) {
-        printf("> download '%s' libraries from '%s' using the script \n(%s)\n",
-                pkg_name.data(), url.data(), cmd.data());
-    }
+    auto import_fn = [&](const std::string& dir) -> std::vector<ZLibrary*> {
+        if (!header_lib) return ImportLibraries(pkg_name, dir);
+        auto lib = ImportLibrary(pkg_name, {dir + "/include"}, "");
+        if (!lib) return {};
+        return {lib};
+    };
+    std::string store_dir = fs::absolute(*AccessPackageStoreDir()).lexically_normal();
+    if ('/' == *store_dir.rbegin()) store_dir.pop_back();
+    const auto key = StringMd5(url + "\n" + compile_cmd + "\n" + (header_lib ? "1" : "0") + "\n" +
+            GetToolchainFingerprint());
+    const auto pkg_dir = store_dir + "/" + pkg_name + "-" + key;
+    fs::create_directories(store_dir);
+
+    //the package is built into a temporary dir, which is renamed to 'pkg_dir' under the lock once it's
+    //built successfully, so 'pkg_dir' is either complete or absent, and the concurrent builds of other
+    //projects wait for the lock, then find the '.done' file and reuse it
+    int lock_fd = open((pkg_dir + ".lock").data(), O_CREAT | O_RDWR, 0666);
+    if (lock_fd < 0 || 0 != flock(lock_fd, LOCK_EX)) {
+        ZTHROW("lock the package '%s' in the store(%s) failed", pkg_name.data(), store_dir.data());
+    }
+    std::shared_ptr<int> lock_guard(&lock_fd, [](int* fd) { close(*fd); });
     int ret_code = 0;
-    ExecuteCmd(cmd, &ret_code);
+    if (fs::exists(pkg_dir + "/.done")) {
+        if (*AccessDebugLevel() > 0) {
+            printf("> reuse '%s' libraries from the package store(%s)\n", pkg_name.data(), pkg_dir.data());
+        }
+    } else {
+        //the package might be made read-only before a failed import, and the temporary dirs might be
+        //left by the killed builds
+        ExecuteCmd(StringPrintf("chmod -R u+w %s %s.tmp.* 2>/dev/null; rm -rf %s %s.tmp.*", pkg_dir.data(),
+                pkg_dir.data(), pkg_dir.data(), pkg_dir.data()));
+        const auto tmp_dir = StringPrintf("%s.tmp.%d", pkg_dir.data(), (int)getpid());
+        //fetch the source from a local path, a 'file://' url, the mirror dir or the network
+        std::string local_src;
+        const auto mirror_file = *AccessPackageMirrorDir() + "/" + GetFilenameFromPath(url);
+        if (StringBeginWith(url, "file://")) local_src = url.substr(7);
+        else if ('/' == url.at(0) || fs::exists(url)) local_src = fs::absolute(url).lexically_normal();
+        else if ("" != *AccessPackageMirrorDir() && fs::exists(mirror_file)) local_src = mirror_file;
+        auto fetch_cmd = ("" != local_src) ? StringPrintf("cp -r \"%s\" .", local_src.data()) :
+                StringPrintf("wget -q \"%s\"", url.data());
+        auto cmd = StringPrintf("mkdir -p %s\n"
+                "cd %s\n"
+                "%s || exit 1\n"
+                "f=$(ls)\n"
+                "if [ -f \"$f\" ]; then\n"
+                "  tar zxf $f --no-same-owner || unzip $f || exit 1\n"
+                "  rm -f $f\n"
+                "fi\n"
+                "f=$(ls)\n"
+                "cd $f\n"
+                "%s #compile cmd\n"
+                "rc=$?; [ $rc -ne 0 ] && exit $rc\n"
+                "cd ..\n"
+                "rm -rf $f && touch .done", tmp_dir.data(), tmp_dir.data(), fetch_cmd.data(),
+                "" != compile_cmd ? compile_cmd.data() :
+                        "./configure --prefix=$(readlink -f ..) && make -j2 && make install");
+        if (*AccessDebugLevel() > 0) {
+            printf("> download '%s' libraries from '%s' into the package store using the script \n(%s)\n",
+                    pkg_name.data(), url.data(), cmd.data());
+        }
+        ExecuteCmd(cmd, &ret_code);
+        std::error_code ec;
+        if (0 == ret_code) fs::rename(tmp_dir, pkg_dir, ec);
+        if (0 != ret_code || ec) {
+            ExecuteCmd(StringPrintf("chmod -R u+w %s 2>/dev/null; rm -rf %s", tmp_dir.data(), tmp_dir.data()));
+            if (ec) {
+                ZTHROW("move the package '%s' into the store(%s) failed: %s", pkg_name.data(),
+                        pkg_dir.data(), ec.message().data());
+            }
+        }
+    }
+    //the project refers to the package through the link, and the libs are imported through the link,
+    //so that the paths used by the project are stable even if the store dir changes
+    const auto pkg_link = *AccessBuildRootDir() + ".downloads/" + pkg_name;
     std::vector<ZLibrary*> libs;
+    std::string import_error;
     if (0 == ret_code) {
-        if (!header_lib) libs = ImportLibraries(pkg_name, pkg_dir);
-        else {
-            auto lib = ImportLibrary(pkg_name, {pkg_dir + "/include"}, "");
-            if (lib) libs.push_back(lib);
+        std::error_code ec;
+        if (!fs::is_symlink(pkg_link) || fs::read_symlink(pkg_link) != pkg_dir) {
+            fs::remove_all(pkg_link, ec);
+            fs::create_directories(GetDirnameFromPath(pkg_link));
+            fs::create_directory_symlink(pkg_dir, pkg_link);
+        }
+        try {
+            libs = import_fn(pkg_link);
+        } catch (const std::exception& e) {
+            import_error = StringPrintf(": %s", e.what());
         }
     }
-    if (libs.empty() || 0 != ret_code) {
-        fs::remove(pkg_dir + "/.done");
+    if (0 != ret_code) {
         ZTHROW("download '%s' libraries from '%s' failed, ret_code:%d",
                 pkg_name.data(), url.data(), ret_code);
     }
+    if (libs.empty()) {
+        //drop the '.done' file to rebuild the package next time, the package might be read-only already
+        std::error_code ec;
+        ExecuteCmd(StringPrintf("chmod u+w %s", pkg_dir.data()));
+        fs::remove(pkg_dir + "/.done", ec);
+        if (ec) import_error += ", and drop its '.done' file failed: " + ec.message();
+        ZTHROW("import '%s' libraries from the package store(%s) failed%s", pkg_name.data(), pkg_dir.data(),
+                import_error.data());
+    }
+    //the packages in the store are shared by all projects, so they are made read-only
+    if (!fs::exists(pkg_dir + "/.readonly")) {
+        StringToFile("", pkg_dir + "/.readonly");
+        ExecuteCmd(StringPrintf("chmod -R a-w %s", pkg_dir.data()));
+    }
     return libs;
 }
 void ImportExternalZmakeProject(const std::string& ext_prj_name, const std::string& ext_prj_path) {
@@ -1424,6 +3650,52 @@ void ImportExternalZmakeProject(const std::string& ext_prj_name, const std::stri
     }
 }
 
+void BuildExternalZmakeProject(const std::string& ext_prj_name, const std::string& ext_prj_path) {
+    std::string name = ext_prj_name;
+    if ('@' == name.at(0)) name = name.substr(1);
+    if ('/' == *name.rbegin()) name.pop_back();
+    if (std::string::npos != name.find('/')) {
+        ZTHROW("ext_prj_name(%s) should not contain '/' in the middle of it", ext_prj_name.data());
+    }
+    std::string ext_prj_root = fs::absolute(ext_prj_path).lexically_normal();
+    if ('/' != *ext_prj_root.rbegin()) ext_prj_root += "/";
+    auto& ext_prjs = GlobalExternalProjects();
+    if (ext_prjs.count(name)) {
+        if (ext_prjs[name].prj_root_dir != ext_prj_root) {
+            ZTHROW("external project(%s) conflicts, root dir: prev(%s) vs cur(%s)", name.data(),
+                    ext_prjs[name].prj_root_dir.data(), ext_prj_root.data());
+        }
+        return;
+    }
+    ext_prjs[name] = {ext_prj_root, ext_prj_root + BUILD_DIR_NAME + "/"};
+
+    //the BUILD.inc files of the external project are compiled into BUILD.exe by `zmake` under this dir
+    std::string builders_dir;
+    {
+        ExternalProjectGuard guard("");
+        builders_dir = *AccessBuildRootDir() + ".external/" + name + "/";
+    }
+    ExternalProjectGuard guard(name);
+    bool found = false;
+    for (auto& x : BuilderBase::GlobalBuilders()) {
+        if (!StringBeginWith(x.first, builders_dir)) continue;
+        found = true;
+        auto old_cwd = GetCurrentDir();
+        fs::path p(ext_prj_root + fs::path(x.first).parent_path().lexically_relative(builders_dir).string());
+        ChangeCurrentDir(p.lexically_normal());
+        auto builder = (x.second)();
+        ColorPrint(StringPrintf("* Start to analyze targets of '@%s' under the directory %s\n", name.data(),
+                p.lexically_normal().string().data()), CT_BRIGHT_CYAN);
+        builder->Run();
+        delete builder;
+        ChangeCurrentDir(old_cwd);
+    }
+    if (!found) {
+        ZTHROW("the building rules of external project(%s) haven't been compiled into BUILD.exe, "
+                "please run `zmake` again", ext_prj_root.data());
+    }
+}
+
 ZBinary* AccessBinary(const std::string& bin_name) {
     auto*& f = AccessFileInternal(bin_name);
     if (!f) f = ZF::Create<ZBinary>(ConvertToProjectInnerPath(bin_name));
@@ -1453,36 +3725,35 @@ auto& GlobalTargets() {
     return s_targets;
 }
 
+//each file is built once all of its deps have been built, which is tracked by counting down the
+//unbuilt deps over a snapshot of the graph, so every node is visited only once no matter how many
+//paths lead to it
 void ConcurrentBuild(std::vector<ZFile*> files, int thread_num = -1) {
-    TaskRunnerPool thread_pool(thread_num, true);
+    const auto graph = ZF::SnapshotGraph(files);
+    if (graph.nodes.empty()) return;
+    std::vector<std::atomic<uint32_t>> pending_deps(graph.nodes.size());
+    for (size_t i = 0; i < graph.nodes.size(); ++i) pending_deps[i] = graph.dep_counts[i];
+    std::atomic<size_t> pending_nodes(graph.nodes.size());
+    std::promise<void> all_done;
+    auto all_done_future = all_done.get_future();
 
-    std::set<ZFile*> built_ok_deps;
-    std::mutex mtx;
-    std::function<void(ZFile*, const std::shared_ptr<ZFile>&)> build_func;
-    build_func = [&](ZFile* file, const std::shared_ptr<ZFile>& base) {
-        {
-            std::lock_guard<std::mutex> guard(mtx);
-            if (built_ok_deps.count(file)) return;
-        }
-        std::shared_ptr<ZFile> deps_build_done{file,
-            [&thread_pool, base, &built_ok_deps, &mtx](ZFile* file) {
-            thread_pool.AddTask([file, base, &built_ok_deps, &mtx](std::string* task_sign) {
-                if (task_sign) *task_sign = file->GetFilePath();
-                else {
-                    file->Build();
-                    RunWithLock(mtx, [&]() { built_ok_deps.insert(file); });
-                }
-            });
-        }};
-        for (auto dep : file->GetDeps()) build_func(dep, deps_build_done);
+    TaskRunnerPool thread_pool(thread_num, true);
+    std::function<void(uint32_t)> schedule_fn = [&](uint32_t idx) {
+        thread_pool.AddTask([&, idx](std::string* task_sign) {
+            auto file = graph.nodes[idx];
+            if (task_sign) {
+                *task_sign = file->GetFilePath();
+                return;
+            }
+            file->Build();
+            for (auto k = graph.offsets[idx]; k < graph.offsets[idx + 1]; ++k) {
+                if (1 == pending_deps[graph.users[k]].fetch_sub(1)) schedule_fn(graph.users[k]);
+            }
+            if (1 == pending_nodes.fetch_sub(1)) all_done.set_value();
+        });
     };
-
-    std::packaged_task<void()> ptask([]() {});
-    {
-        std::shared_ptr<ZFile> done(nullptr, [&ptask](ZFile* file) { ptask(); });
-        for (auto f : files) build_func(f, done);
-    }
-    ptask.get_future().wait();
+    for (size_t i = 0; i < graph.nodes.size(); ++i) if (0 == graph.dep_counts[i]) schedule_fn(i);
+    all_done_future.wait();
 }
 
 ZFile* AddTarget(const std::string& name) {
@@ -1516,7 +3787,18 @@ std::map<std::string, T*> ListFiles(const std::string& dir) {
 }
 
 void BuildAll(bool export_libs, int concurrency_num) {
+    //load the records of the main project, before any file of external projects is built
+    Md5Cache::GetAll();
+    BuildTimes::GetAll();
     for (auto runner : GlobalRBB()) runner();
+    ZF::ApplyProtoImports();
+    ZF::ApplyModules();
+    ZF::ApplyPGO();
+    ZF::ApplyLayoutOptimization();
+    ZF::ApplyLTO();
+    //the same as the default thread num of TaskRunnerPool
+    JobSlots::Init(concurrency_num > 0 ? concurrency_num :
+            std::max(std::thread::hardware_concurrency() / 4, 1u));
     std::vector<ZFile*> files(GlobalTargets().begin(), GlobalTargets().end());
     if (files.empty()) {
         for (auto x : GlobalFiles()) {
@@ -1527,8 +3809,17 @@ void BuildAll(bool export_libs, int concurrency_num) {
             }
         }
     }
-    if (1 == concurrency_num) for (auto f : files) f->Build();
+    ZF::ScanIncludes(files);
+    ZF::ApplyVariants(&files);
+    ZF::ApplyProtoBatches(files);
+    //explain mode runs the analysis only, so there is no need to do it concurrently
+    if (1 == concurrency_num || *AccessExplainMode()) for (auto f : files) f->Build();
     else ConcurrentBuild(files, concurrency_num);
+    if (*AccessExplainMode()) {
+        ZF::PrintExplanation();
+        return;
+    }
+    if (*AccessTimeTraceMode()) ZF::ReportTimeTrace(files);
     for (auto runner : GlobalRAB()) runner();
 
     ProcessDepsRecursively(files, [](ZFile* f) {
@@ -1542,6 +3833,16 @@ void BuildAll(bool export_libs, int concurrency_num) {
         } else md5s_oss << x.second << std::endl;
     }
     StringToFile(md5s_oss.str(), GetBuildPath("BUILD.md5s"));
+    BuildTimes::Save();
+
+    if (!GlobalFailedFiles().empty()) {
+        ColorPrint(StringPrintf("* Build failed, %lu target(s) failed:\n", GlobalFailedFiles().size()),
+                CT_BRIGHT_RED);
+        for (auto f : GlobalFailedFiles()) {
+            ColorPrint(StringPrintf("  %s, file: %s\n", f->GetName().data(), FP(f)), CT_RED);
+        }
+        exit(2);
+    }
 
     if (!export_libs) return;
 
@@ -1553,6 +3854,7 @@ void BuildAll(bool export_libs, int concurrency_num) {
         << "#using ';' as the separator for lib_include_dirs and deps"     << std::endl;
     for (auto& x : ListFiles<ZLibrary>("/")) {
         auto p = x.second->GetFilePath();
+        if (StringBeginWith(p, build_root_dir + ".variants/")) continue;
         if (!StringBeginWith(GetDirnameFromPath(p), build_root_dir)) {
             fprintf(stderr, "[Warn]this lib target(%s) is out of build root dir(%s)\n",
                     p.data(), build_root_dir.data());
@@ -1582,6 +3884,11 @@ void BuildAll(bool export_libs, int concurrency_num) {
 }
 
 void InstallAll() {
+    if (*AccessExplainMode()) return;
+    if (!AccessBuildVariants()->empty()) {
+        ColorPrint("* Skip installing targets, since only the build variants are built\n", CT_YELLOW);
+        return;
+    }
     for (const auto& x : GlobalInstallTargets()) {
         for (const auto& dst : x.second) {
             if (FSCO::none != (dst.second & FSCO::create_symlinks)) fs::remove(dst.first);
@@ -1612,6 +3919,103 @@ std::vector<ZFile*> ListAllTargets(const std::string& dir) {
     return ListTargets<ZFile>(dir);
 }
 
+void ReportHeaderCosts(size_t top_n) {
+    const auto& prj_root = *AccessProjectRootDir();
+    std::map<ZFile*, std::vector<ZObject*>> header_users;
+    std::map<ZObject*, std::set<ZFile*>> obj_headers;
+    for (auto& x : GlobalFiles()) {
+        if (!x.second || FT_OBJ_FILE != x.second->GetFileType()) continue;
+        auto obj = (ZObject*)x.second;
+        if (obj_headers.count(obj)) continue;
+        auto& headers = obj_headers[obj];
+        //the header deps are loaded from the '.d' file, so they include all the transitive ones
+        for (auto dep : obj->GetDeps()) {
+            if (!StringEndWith(dep->GetFilePath(), C_CPP_HEADER_SUFFIXES)) continue;
+            headers.insert(dep);
+            if (StringBeginWith(dep->GetFilePath(), prj_root)) header_users[dep].push_back(obj);
+        }
+    }
+    if (header_users.empty()) {
+        printf("no project header is found, please build the project firstly to generate '.d' files\n");
+        return;
+    }
+
+    long known_ms = 0, known_num = 0;
+    for (auto& x : obj_headers) {
+        auto ms = BuildTimes::Get(x.first->GetFilePath());
+        if (ms >= 0) known_ms += ms, ++known_num;
+    }
+    //the objs which have never been built are estimated by the average compile time of others
+    long avg_ms = known_num ? known_ms / known_num : 0;
+    struct HeaderCost {
+        ZFile* header;
+        long cost_ms;
+        size_t closure;
+        long changes;
+    };
+    std::vector<HeaderCost> costs;
+    for (auto& x : header_users) {
+        long cost_ms = 0;
+        for (auto obj : x.second) {
+            auto ms = BuildTimes::Get(obj->GetFilePath());
+            cost_ms += (ms >= 0 ? ms : avg_ms);
+        }
+        costs.push_back({x.first, cost_ms, 0, -1});
+    }
+    std::sort(costs.begin(), costs.end(), [](const HeaderCost& a, const HeaderCost& b) {
+        return a.cost_ms != b.cost_ms ? a.cost_ms > b.cost_ms : a.header->GetFilePath() < b.header->GetFilePath();
+    });
+    if (costs.size() > top_n) costs.resize(top_n);
+
+    //'.d' files have no edges between headers, so the closure of a header is estimated by the headers
+    //included by all the objs which include it, which is an upper bound
+    std::vector<size_t> closures;
+    for (auto& c : costs) {
+        const auto& users = header_users[c.header];
+        auto closure = obj_headers[users[0]];
+        for (size_t i = 1; i < users.size() && closure.size() > 1; ++i) {
+            std::set<ZFile*> common;
+            const auto& headers = obj_headers[users[i]];
+            std::set_intersection(closure.begin(), closure.end(), headers.begin(), headers.end(),
+                    std::inserter(common, common.begin()));
+            closure.swap(common);
+        }
+        c.closure = closure.size() - 1; //exclude itself
+        closures.push_back(c.closure);
+    }
+    std::nth_element(closures.begin(), closures.begin() + closures.size() / 2, closures.end());
+    const size_t median_closure = closures[closures.size() / 2];
+
+    //the change frequency of headers in recent 90 days if the project is managed by git
+    int ret_code = 0;
+    auto git_root = ExecuteCmd(StringPrintf("cd %s && git rev-parse --show-toplevel 2>/dev/null",
+            prj_root.data()), &ret_code);
+    if (0 == ret_code && "" != git_root) {
+        std::map<std::string, long> changes;
+        for (const auto& f : StringSplit(ExecuteCmd(StringPrintf("cd %s && git log --since='90 days ago' "
+                "--name-only --format= 2>/dev/null", git_root.data())), '\n')) {
+            if ("" != f) ++changes[git_root + "/" + f];
+        }
+        for (auto& c : costs) c.changes = changes[c.header->GetFilePath()];
+    }
+
+    ColorPrint(StringPrintf("* Header rebuild costs(top %lu of %lu project headers), cost = total compile "
+            "time of the objs including it:\n", costs.size(), header_users.size()), CT_BRIGHT_CYAN);
+    printf("  %10s %6s %8s %8s  %s\n", "cost(s)", "objs", "closure", "changes", "header");
+    for (auto& c : costs) {
+        //a closure much larger than the ones of others is a good candidate to split or forward-declare
+        bool large_closure = (c.closure >= 20 && c.closure > 4 * median_closure);
+        printf("  %10.1f %6lu %8lu %8s  %s%s\n", c.cost_ms / 1000.0, header_users[c.header].size(),
+                c.closure, c.changes < 0 ? "-" : std::to_string(c.changes).data(),
+                fs::path(c.header->GetFilePath()).lexically_relative(prj_root).c_str(),
+                large_closure ? "  [large closure]" : "");
+    }
+    if (known_num < (long)obj_headers.size()) {
+        printf("  %lu obj(s) have no recorded compile time, which are estimated by the average(%ld ms)\n",
+                obj_headers.size() - known_num, avg_ms);
+    }
+}
+
 void RegisterTargetInstall(const std::string& name, const std::string& dst_path, FSCO opts) {
     auto f = AccessFileInternal(name);
     if (!f) ZTHROW("install failed, can't find the target(%s)", name.data());
@@ -1621,11 +4025,18 @@ void RegisterTargetInstall(ZFile* file, const std::string& dst_path, FSCO opts)
     GlobalInstallTargets()[file->GetFilePath()].push_back({dst_path, opts});
 }
 
+//the runners registered by an external project run under it as well
 void RegisterRunnerBeforeBuildAll(std::function<void()> runner) {
-    GlobalRBB().push_back(std::move(runner));
+    GlobalRBB().push_back([ext_prj = CurrentExternalProject(), runner]() {
+        ExternalProjectGuard guard(ext_prj);
+        runner();
+    });
 }
 void RegisterRunnerAfterBuildAll(std::function<void()> runner) {
-    GlobalRAB().push_back(std::move(runner));
+    GlobalRAB().push_back([ext_prj = CurrentExternalProject(), runner]() {
+        ExternalProjectGuard guard(ext_prj);
+        runner();
+    });
 }
 
 } //end of namespace zmake
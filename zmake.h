@@ -1,3 +1,6 @@
+#ifndef ZMAKE_H_
+#define ZMAKE_H_
+
 #include <string>
 #include <vector>
 #include <map>
@@ -6,7 +9,14 @@
 #include <filesystem>
 #include <unordered_map>
 
-#define C_CPP_SOURCE_SUFFIXES ".cpp|.cc|.c|.cxx|.CPP|.CC|.C|.CXX"
+//C++20 module units can be added as normal sources(the obj of "a.cppm" is "a.cppm.o", so that it
+//won't conflict with "a.cpp"); before building, the module declarations and imports in the preamble
+//of all sources are scanned, then the objs providing modules(and the header units imported by
+//'import <vector>;' or 'import "a.h";') are built before their importers, and the importers get the
+//mapping from module names to CMI files(under '.zmade/.modules/') automatically; since the sources
+//are scanned without preprocessing, the imports under '#if' are always regarded as imported.
+#define CPP_MODULE_SUFFIXES ".cppm|.ixx|.cxxm|.ccm"
+#define C_CPP_SOURCE_SUFFIXES ".cpp|.cc|.c|.cxx|.CPP|.CC|.C|.CXX|" CPP_MODULE_SUFFIXES
 #define C_CPP_HEADER_SUFFIXES ".h|.hh|.hpp|.hxx|.H|.HH|.HPP|.HXX"
 
 namespace zmake {
@@ -22,7 +32,20 @@ enum FileType {
     FT_BINARY_FILE = 7,
 };
 
+enum ArchiveMode {
+    AM_FULL = 0, //recreate the whole archive with all objects on every change
+    AM_INCREMENTAL = 1, //only replace the changed objects in the existing archive
+    AM_THIN = 2, //thin archive, which only references objects in place, so it can't be copied elsewhere
+};
+
+enum LtoMode {
+    LTO_NONE = 0,
+    LTO_FULL = 1,
+    LTO_THIN = 2, //ThinLTO of clang; gcc has no ThinLTO, so its default partitioned LTO is used
+};
+
 struct ZConfig;
+struct ZVariant;
 struct ZFile;
 struct ZObject;
 struct ZLibrary;
@@ -91,6 +114,9 @@ std::vector<std::string> Glob(const std::vector<std::string>& rules,
 ZObject*  AccessObject(const std::string& src_file, const std::string& obj_file = "");
 //if this lib already exists, 'is_static_lib' will be ignored, which is only used to create this lib;
 //you can also access the imported lib, such as using '@gflags' as the 'lib_name'.
+//for a shared lib, an interface stub('libxxx.so.ifs') with its exported dynamic symbols is generated
+//after linking, and its dependents will be relinked only when this stub changes; without <elf.h>(e.g.:
+//on macOS), the stub is the md5 of the whole lib, i.e.: any change of the lib relinks its dependents.
 ZLibrary* AccessLibrary(const std::string& lib_name, bool is_static_lib = true);
 ZBinary*  AccessBinary(const std::string& bin_name); //such as: "rpc_replay" or "tools/rpc_replay"
 //for other cases, you might need create/get just a ZFile*, for example, you can create a file that
@@ -111,8 +137,19 @@ ZLibrary* ImportLibrary(const std::string& lib_name, const std::vector<std::stri
 std::vector<ZLibrary*> ImportLibraries(const std::string& pkg_name, const std::string& dir);
 //by default, use following shell script to compile, and you can replace it by 'compile_cmd':
 //  ./configure --prefix=$(readlink -f ..) && make -j2 && make install
+//the package is built once into the machine-wide package store(see AccessPackageStoreDir), which is
+//keyed by 'url', 'compile_cmd' and the fingerprint of the default C/C++ compilers, and it's shared by
+//all projects through the read-only link '.zmade/.downloads/<pkg_name>'; 'url' could also be a local
+//path or a 'file://' url of an archive or a source dir.
 std::vector<ZLibrary*> DownloadLibraries(const std::string& pkg_name, const std::string& url,
         const std::string& compile_cmd = "", bool header_lib = false);
+//the dir of the package store, '$ZMAKE_PACKAGE_STORE' or '~/.zmake/packages/' by default; concurrent
+//builds populating the same package are serialized by a file lock, and a package is built in a temporary
+//dir(i.e.: '..' of 'compile_cmd'), which is renamed into the store only after it's built successfully.
+std::string* AccessPackageStoreDir();
+//if set, the file with the same filename as the url of DownloadLibraries is fetched from this dir
+//instead of downloading, so it can work fully offline with a local mirror dir.
+std::string* AccessPackageMirrorDir();
 
 //if you have another project built by zmake, you can easily import it by this API, such as
 //  ImportExternalZmakeProject("common_utils", "/workspace/common_utils/");
@@ -120,7 +157,15 @@ std::vector<ZLibrary*> DownloadLibraries(const std::string& pkg_name, const std:
 //  AccessLibrary("service_core")
 //    ->AddDepLibs({"@common_utils/net", "@common_utils/string"});
 void ImportExternalZmakeProject(const std::string& ext_prj_name, const std::string& ext_prj_path);
-//TODO support BuildExternalZmakeProject(const std::string& ext_prj_path);
+//instead of importing the libs built and exported by another zmake project beforehand, build it in the
+//same BuildAll, so that one '-j' budget and one up-to-date analysis cover both projects, such as:
+//  BuildExternalZmakeProject("common_utils", "/workspace/common_utils/");
+//  AccessLibrary("service_core")
+//    ->AddDepLibs({"@common_utils/net", "@common_utils/string"});
+//its building rules are run in-process under its own project root and build root(its '.zmade/'),
+//and its libs/binaries are named with the prefix '@<ext_prj_name>'; since `zmake` finds its BUILD.inc
+//files by scanning this call in your BUILD.inc, both params must be string literals.
+void BuildExternalZmakeProject(const std::string& ext_prj_name, const std::string& ext_prj_path);
 
 //name could be src_file/lib_name/bin_name or a file that could be generated
 ZFile* AddTarget(const std::string& name);
@@ -136,10 +181,19 @@ std::vector<ZObject*>  ListObjectTargets(const std::string& dir = ".");
 std::vector<ZLibrary*> ListLibraryTargets(const std::string& dir = ".");
 std::vector<ZBinary*>  ListBinaryTargets(const std::string& dir = ".");
 std::vector<ZFile*>    ListAllTargets(const std::string& dir = ".");
+//rank the project headers by rebuild cost, which is the total compile time(recorded in 'BUILD.times')
+//of the objs including them directly or transitively, based on the '.d' files of last build; the
+//number of changes in recent 90 days is shown if the project is managed by git, and the headers
+//pulling in disproportionately large closures of other headers are flagged.
+void ReportHeaderCosts(size_t top_n = 20);
 
 //return the reference, so you can modify the root dir
 std::string* AccessProjectRootDir(); //the dir where you run ./BUILD
 std::string* AccessBuildRootDir(); //by default, it's *AccessProjectRootDir()/.zmade/
+//the current dir is cached since every resolution of a relative path needs it, so please change it by
+//ChangeCurrentDir instead of fs::current_path(dir) or chdir in the building rules.
+const std::string& GetCurrentDir();
+void ChangeCurrentDir(const std::string& dir);
 
 //the stdout of zmake can be classified based on the first character:
 //  *: the main stage of zmake
@@ -148,6 +202,52 @@ std::string* AccessBuildRootDir(); //by default, it's *AccessProjectRootDir()/.z
 //  >: debug info
 void SetVerboseMode(bool verbose = true);
 void SetDebugLevel(uint32_t level = 1); //current only support 1 or 2
+//if the length of a compile/link cmd exceeds 'threshold', its long parts(include dirs for obj, or
+//objs and libs for library/binary) will be moved into a response file and passed by '@file';
+//objs with the same include dirs share one response file; 0 means never using response file.
+void SetResponseFileThreshold(size_t threshold = 32768);
+//by default, all running jobs will be killed once any job fails; in keep-going mode, the failed target
+//and all targets that depend on it are marked as failed, but all other independent targets will still
+//be built, and BuildAll will exit with non-zero code and list the failed targets at the end.
+void SetKeepGoingMode(bool keep_going = true);
+//dry run: do the same up-to-date analysis as building without executing any cmd, and list the files
+//which would be rebuilt with the reasons and the changed inputs triggering them; the wall time is
+//estimated by the durations of their last builds(recorded in 'BUILD.times') and the '-j' slots;
+//since early cutoff can't be predicted without building, the result is an upper bound.
+//nothing is written under the build root dir by the analysis in this mode, while `zmake --explain`
+//still builds BUILD.exe itself, and DownloadLibraries still fetches the missing packages.
+void SetExplainMode(bool explain = true);
+//the way to build static libraries, AM_INCREMENTAL by default, and it can be overridden by
+//ZLibrary::SetArchiveMode; archives are always created in deterministic mode('D' flag of ar).
+void SetArchiveMode(ArchiveMode mode = AM_INCREMENTAL);
+//fast-link profile for development: objs are compiled with '-g -gsplit-dwarf'(the '.dwo' files are
+//tracked as outputs of objs), and binaries/shared libs are linked by mold, lld or gold(the first one
+//found in $PATH) with '--gdb-index' and multi-threading; if none of them is found, the default
+//linker is used, only split DWARF takes effect then.
+void EnableFastLink(bool enable = true);
+//enable LTO for all binaries and shared libs, which can be overridden by ZBinary::EnableLTO; all objs
+//linked into them(including the ones inside static libs they depend on) are compiled with '-flto',
+//and these static libs are created by gcc-ar/llvm-ar; the LTO backend jobs of a link occupy all the
+//'-j' slots, and the cache of ThinLTO locates under '.zmade/.lto_cache/'.
+void EnableLTO(LtoMode mode = LTO_FULL);
+//compiler self-profile: all objs are recompiled with '-ftime-trace'(clang) or '-ftime-report'(gcc),
+//which doesn't change the objs, so nothing else is rebuilt and the next normal build is a no-op;
+//the results are aggregated across the whole build into '.zmade/time_trace.tsv'(category, name,
+//total ms and count, e.g.: time of parsing each header, instantiating each template and generating
+//each function) and a merged chrome trace '.zmade/time_trace.json'; gcc only reports the time of
+//its phases and passes, so there is no breakdown by header, template or function for gcc.
+void EnableTimeTrace(bool enable = true);
+//a build variant builds all targets into its own output dir '.zmade/.variants/<name>/' with its own
+//compile/link flags, which are appended to the ones of objs/libs/binaries(the '-O' flag replaces the
+//original optimization level instead); config-independent files(e.g.: headers generated by protoc or
+//generators, and imported libs) are shared by all variants; built-in variants:
+//  debug:   -O0 -g
+//  release: -O2 -DNDEBUG
+//  asan:    -O1 -g -fsanitize=address -fno-omit-frame-pointer(link with -fsanitize=address)
+ZVariant* AccessVariant(const std::string& name);
+//build these variants in one run instead of the default build, e.g.: SetBuildVariants({"debug", "release"});
+//since each variant has its own outputs, switching between them rebuilds nothing after the first build.
+void SetBuildVariants(const std::vector<std::string>& names);
 //if no target is added by AddTarget, all targets will be built;
 //if 'export_libs' is true, the 'BUILD.libs' file will be generated under build root dir, which
 //will be used by other projects when current project plays as an external project.
@@ -176,6 +276,43 @@ private:
     std::unordered_map<std::string, std::string> _flags;
 };
 
+struct ZVariant {
+    ZVariant* SetCompileFlags(const std::vector<std::string>& flags) { _compile_conf.SetFlags(flags); return this; }
+    ZVariant* SetLinkFlags(const std::vector<std::string>& flags) { _link_conf.SetFlags(flags); return this; }
+    const ZConfig& GetCompileConfig() const { return _compile_conf; }
+    const ZConfig& GetLinkConfig() const { return _link_conf; }
+
+private:
+    ZConfig _compile_conf;
+    ZConfig _link_conf;
+};
+
+//the deps of a file, which are kept as the node ids in the adjacency arrays of the build graph rather
+//than in the file itself; it never dangles, but the deps added after getting it aren't visible in it
+struct DepRange {
+    struct Iterator {
+        ZFile* operator*() const;
+        Iterator& operator++() { ++_p; return *this; }
+        bool operator==(const Iterator& other) const { return _p == other._p; }
+        bool operator!=(const Iterator& other) const { return _p != other._p; }
+        const uint32_t* _p;
+    };
+    Iterator begin() const { return {_ids}; }
+    Iterator end() const { return {_ids + _size}; }
+    size_t size() const { return _size; }
+    bool empty() const { return 0 == _size; }
+    ZFile* operator[](size_t i) const { return *Iterator{_ids + i}; }
+    operator std::vector<ZFile*>() const {
+        std::vector<ZFile*> files;
+        files.reserve(_size);
+        for (auto f : *this) files.push_back(f);
+        return files;
+    }
+
+    const uint32_t* _ids = nullptr;
+    uint32_t _size = 0;
+};
+
 struct ZFile {
     virtual ~ZFile();
 
@@ -191,7 +328,7 @@ struct ZFile {
     //watch these files' changes and decide whether recompile or not;
     ZFile* AddDep(ZFile* dep);
     ZFile* AddDep(const std::string& dep);
-    const std::vector<ZFile*>& GetDeps() const;
+    DepRange GetDeps() const;
     //dump to stdout if dump_sinker is nullptr
     void DumpDepsRecursively(std::string* dump_sinker = nullptr) const;
     //only use this API to add dependent libraries, and support '*' as the last character
@@ -208,10 +345,10 @@ struct ZFile {
     std::string GetFullCommand(bool print_pretty = false);
 
     //absolute path for the target file, such as ".o", ".a", ".so" or binary
-    std::string GetFilePath() const;
+    const std::string& GetFilePath() const;
     FileType GetFileType() const;
-    std::string GetCwd() const;
-    std::string GetName() const { return _name; }
+    const std::string& GetCwd() const;
+    const std::string& GetName() const { return _name; }
 
     //build this obj/library/binary, or generate the file based on its generator
     //return whether the build process really occurs or not
@@ -220,24 +357,39 @@ struct ZFile {
     //add this file as a target, this API equals to: AddTarget(this);
     void BeTarget();
 
+    //the files are the nodes of the build graph which live until exit, so they're allocated from
+    //big chunks one after another instead of one by one, and never freed; the hot fields of the
+    //nodes(e.g.: the type, the build states, the mtime and the deps) are kept in the arrays indexed
+    //by '_id' instead(see NodeTable in zmake.cpp), so a ZFile* is mostly a handle of its node id
+    static void* operator new(size_t size);
+    static void operator delete(void*) {}
+
 protected:
     ZFile(const std::string& path, FileType ft, bool need_build);
     virtual bool ComposeCommand();
+    //the cmd really executed to build, which may differ from '_cmd', e.g.: incremental archiving;
+    //'cmd_changed' means '_cmd' differs from the one of last successful build
+    virtual std::string ComposeExecCommand(bool cmd_changed) { return _cmd; }
+    std::string ComposeLtoExecCommand(LtoMode mode);
+    //the build states(NS_* in zmake.cpp) of this node kept in the node table
+    bool HasState(uint8_t state) const;
+    void SetState(uint8_t state, bool val = true);
 
     std::string _file;
     std::string _name;
     std::string _compiler = "";
-    FileType _ft = FT_NONE;
     std::string _cmd;
+    std::string _exec_cmd;
+    int _job_weight = 1; //the number of '-j' slots occupied by running '_exec_cmd'
+    std::vector<std::pair<std::string, std::string>> _rsp_files; //response file path -> content
+    std::vector<std::string> _gen_files; //files generated by '_cmd' besides '_file'
+    std::string _interface_file; //if not empty, dependents check it instead of '_file' to rebuild
     std::string _cwd;
+    std::string _ext_prj; //the external project built by BuildExternalZmakeProject, "" for the main one
     ZConfig* _conf = nullptr;
     ZGenerator* _generator = nullptr;
-    std::set<std::string> _uniq_deps;
-    std::vector<ZFile*> _deps;
-    bool _build_done = false;
-    bool _has_been_built = false;
-    bool _forced_build = false;
-    bool _generated_by_dep = false;
+    ZVariant* _variant = nullptr; //not null for the files cloned into a build variant
+    uint32_t _id = 0; //the dense index of this node in the build graph, see ZF::RegisterNode
 
     friend class ZF; //Z* Friend
 };
@@ -251,12 +403,20 @@ struct ZObject : public ZFile {
 protected:
     ZObject(const std::string& src_file, const std::string& obj_file = "");
     void AddObjectUser(ZFile* file); //file is a library or binary
+    void LoadDepFile(); //load the header dependencies from the '.d' file generated by compiler
+    void CollectIncludeDirs(); //add the include dirs of the project root and all related libs
     virtual bool ComposeCommand();
+    virtual std::string ComposeExecCommand(bool cmd_changed);
 
     std::vector<std::string> _inc_dirs;
     std::set<std::string> _uniq_inc_dirs;
     std::string _src;
     std::vector<ZFile*> _users;
+    LtoMode _lto_mode = LTO_NONE; //decided by the binaries and shared libs it's linked into
+    bool _has_non_lto_user = false;
+    std::string _module; //the module or partition provided by this obj, e.g.: "a" or "a:part"
+    std::vector<std::string> _imports; //the imported modules and header units, e.g.: "b", "<vector>"
+    std::map<std::string, std::string> _module_map; //module name or header unit path -> CMI file
 
     friend class ZF; //Z* Friend
 };
@@ -300,14 +460,21 @@ struct ZLibrary : public ZFile {
     bool IsUsedAsWholeArchive() const { return _is_whole_archive; }
     ZLibrary* SetUsedAsWholeArchive() { _is_whole_archive = true; return this;}
 
+    //only for static library, refer to SetArchiveMode
+    ZLibrary* SetArchiveMode(ArchiveMode mode) { _archive_mode = mode; return this; }
+    ArchiveMode GetArchiveMode() const;
+
 protected:
     ZLibrary(const std::string& lib_name, bool is_static_lib);
     ZLibrary(const std::string& lib_name, const std::vector<std::string>& inc_dirs, const std::string& lib_file);
     virtual bool ComposeCommand();
+    virtual std::string ComposeExecCommand(bool cmd_changed);
+    std::string GetArchiverPrefix() const;
 
     bool _is_static_lib = true;
     bool _is_whole_archive = false;
     bool _added_protobuf_lib_dep = false;
+    int _archive_mode = -1; //-1 means using the global archive mode
     std::vector<ZObject*> _objs;
     std::vector<std::string> _objs_flags;
     std::vector<ZLibrary*> _libs;
@@ -334,15 +501,40 @@ struct ZBinary : public ZFile {
     ZBinary* AddLinkDir(const std::string& dir);
     const std::vector<std::string>& GetLinkDirs() const;
 
+    //refer to the global EnableLTO
+    ZBinary* EnableLTO(LtoMode mode = LTO_FULL) { _lto_mode = mode; return this; }
+    LtoMode GetLtoMode() const;
+    //profile-guided optimization: an instrumented variant of this binary(with all its objs and
+    //internal static libs) is built under '.zmade/.variants/pgo-XXX/gen/', then 'training_cmd' is
+    //run to collect the profile('${1}' is the path of the instrumented binary), for example:
+    //  EnablePGO("${1} --benchmark data/queries.txt");
+    //finally this binary is linked with the objs rebuilt by '-fprofile-use' under '.../use/'; the
+    //profile is a dependency of all these objs, so they're rebuilt once the profile changes.
+    ZBinary* EnablePGO(const std::string& training_cmd) { _pgo_training_cmd = training_cmd; return this; }
+    //post-link layout optimization: after this binary is built, 'profiling_cmd'('${1}' is the path of
+    //this binary) is run under `perf record`, then the optimized binary '${binary_file}.layout' is
+    //generated by BOLT; if BOLT isn't available, '${binary_file}.layout' is relinked by lld/mold/gold
+    //with the hot functions ordered by the profile, from the clones of its objs(and internal static
+    //libs) compiled with '-ffunction-sections' under '.zmade/.variants/', so that other targets
+    //sharing the objs aren't affected; if neither is available, it's skipped with a warning.
+    ZBinary* EnableLayoutOptimization(const std::string& profiling_cmd) {
+        _layout_profiling_cmd = profiling_cmd;
+        return this;
+    }
+
 protected:
     ZBinary(const std::string& bin_name);
     virtual bool ComposeCommand();
+    virtual std::string ComposeExecCommand(bool cmd_changed);
 
     std::vector<ZObject*> _objs;
     std::vector<std::string> _objs_flags;
     std::vector<ZFile*> _libs;
     std::vector<ZLibrary*> _whole_archive_libs;
     std::vector<std::string> _link_dirs;
+    int _lto_mode = -1; //-1 means using the global LTO mode
+    std::string _pgo_training_cmd;
+    std::string _layout_profiling_cmd;
 
     friend class ZF; //Z* Friend
 };
@@ -377,9 +569,12 @@ struct ZProto : public ZFile {
 protected:
     ZProto(const std::string& proto_file);
     virtual bool ComposeCommand();
+    virtual std::string ComposeExecCommand(bool cmd_changed);
 
     friend ZProto* AccessProto(const std::string&);
     std::vector<std::string> _proto_import_dirs;
+
+    friend class ZF; //Z* Friend
 };
 
 //provide a way to generate some required files,
@@ -404,3 +599,5 @@ protected:
 };
 
 } //end of namespace zmake
+
+#endif /* ZMAKE_H_ */
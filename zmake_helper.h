@@ -44,16 +44,29 @@ void PrintHelpInfo() {
            "  -v \t verbose mode to show full cmd;\n"
            "  -n \t not run ./BUILD.exe after generating it by `zmake`;\n"
            "  -j \t concurrency, -j0 by default, which will use 1/4 CPU cores;\n"
+           "  -k \t keep going(or --keep-going) when some targets fail, all the independent\n"
+           "     \t targets will still be built, and the failed targets are listed at the end;\n"
+           "  --explain \t dry run without executing any cmd, list the files which would be\n"
+           "     \t rebuilt with the reasons, and estimate the wall time by the recorded durations;\n"
            "  -e \t export itself for being imported by other zmake projects, which\n"
            "     \t will generate the '.zmade/BUILD.libs' file;\n"
            "  -c \t constrain targets under a specific dir, using -c dir1/dir2/;\n"
            "  -t \t specify only these targets to be built, which is separated by ';'\n"
            "  -l \t list all target names, which can be used with '-c' flag for a sub dir;\n"
            "  -A \t analyze the target's dependencies and dump to stdout, using -A <target>;\n"
+           "  -H \t report the top N(-H20 by default) headers ranked by rebuild cost, which is the\n"
+           "     \t total compile time of the objs including them, based on the last build;\n"
            "  -s \t simple mode(without any BUILD.inc under your project) for building, just use\n"
            "     \t AccessBinary(${binary_name})->AddObjs(Glob({\"**.cpp\", \"**.cc\", \"**.c\"})),\n"
            "     \t the ${binary_name} will be determined by the filename that contains 'main()';\n"
            "  -g \t add -g for all targets' compilation and link;\n"
+           "  --fast-link \t fast-link profile for development, compile with split DWARF and\n"
+           "     \t link by mold/lld/gold with '--gdb-index' if available;\n"
+           "  --time-trace \t recompile all objs with '-ftime-trace'(clang) or '-ftime-report'(gcc),\n"
+           "     \t and aggregate the results into '.zmade/time_trace.tsv' and '.json';\n"
+           "  --variants \t build these variants(separated by ',') into '.zmade/.variants/<name>/'\n"
+           "     \t instead of the default build, e.g.: --variants debug,release; built-in\n"
+           "     \t variants are debug/release/asan, and more can be defined by AccessVariant;\n"
            "  -O \t set optimization level for all targets' compilation and link forcedly, it\n"
            "     \t will replace targets' optimization level defined in BUILD.inc; it's useful\n"
            "     \t if you want to compile a debug version with -O0;\n"
@@ -0,0 +1,30 @@
+/*
+ * zmake_internal.h
+ *
+ *  The internal functions of zmake.cpp, which aren't a part of the API for the building rules, but are
+ *  shared with the tools built along with zmake(i.e.: BUILD_main.cpp, main.cpp and the benchmarks), so
+ *  that their signatures are checked by the compiler on both sides.
+ */
+
+#ifndef ZMAKE_INTERNAL_H_
+#define ZMAKE_INTERNAL_H_
+
+#include "zmake.h"
+
+namespace zmake {
+
+std::map<std::string, ZFile*>& GlobalFiles();
+std::string ExecuteCmd(const std::string& cmd, int* ret_code = nullptr);
+std::string ConvertToProjectInnerPath(const std::string& p);
+std::string GetBuildPath(const std::string& path);
+std::string FormalizeLibraryName(const std::string& lib_name, bool is_imported_lib = false);
+ZFile*& AccessFileInternal(const std::string& file, bool create_file = false,
+        bool need_build = false, FileType ft = FT_NONE);
+void ProcessDepsRecursively(const std::vector<ZFile*>& deps, const std::function<void(ZFile*)>& fn,
+        std::set<ZFile*>* uniq_deps = nullptr);
+void ProcessDepsRecursively(const DepRange& deps, const std::function<void(ZFile*)>& fn,
+        std::set<ZFile*>* uniq_deps = nullptr);
+
+} //end of namespace zmake
+
+#endif /* ZMAKE_INTERNAL_H_ */
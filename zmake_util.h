@@ -9,13 +9,16 @@
 #define ZMAKE_UTIL_H_
 
 #include <unistd.h>
+#include <string.h>
 #include <string>
+#include <string_view>
 #include <streambuf>
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
 #include <memory>
 #include <set>
+#include <map>
 #include <queue>
 #include <mutex>
 #include <future>
@@ -193,6 +196,19 @@ std::vector<std::string> StringSplit(const std::string& s, char delim = ' ', boo
     else if (reserve_empty_token) tokens.emplace_back(""); // " a" will return two parts, so " a " should return three parts
     return tokens;
 }
+//the non-allocating version of StringSplit, 'fn' is called with each non-empty token in order, and
+//the split stops once 'fn' returns true
+template <typename Fn>
+bool StringSplitForEach(std::string_view s, char delim, const Fn& fn) {
+    size_t p = std::string_view::npos, lp = 0; // pos and last_pos
+    while (lp < s.size()) {
+        p = s.find(delim, lp);
+        if (std::string_view::npos == p) p = s.size();
+        if (p > lp && fn(s.substr(lp, p - lp))) return true;
+        lp = p + 1;
+    }
+    return false;
+}
 template <typename T>
 std::string StringCompose(const T& container, char delim = ';') {
     if (container.empty()) return "";
@@ -207,33 +223,30 @@ std::string StringCompose(const T& container, char delim = ';') {
 
 //suffix support multiple matches split by '|', such as: ".cc|.cpp"
 __attribute__((weak, unused))
-bool StringEndWith(const std::string& str, const std::string& suffix) {
-    for (const auto& x : StringSplit(suffix, '|')) {
-        if (x.size() > str.size()) continue;
-        if (std::equal(x.rbegin(), x.rend(), str.rbegin())) return true;
-    }
-    return false;
+bool StringEndWith(std::string_view str, std::string_view suffix) {
+    return StringSplitForEach(suffix, '|', [str](std::string_view x) {
+        return x.size() <= str.size() && 0 == str.compare(str.size() - x.size(), x.size(), x);
+    });
 }
 
 //prefix support multiple matches split by '|', such as: "lib|Lib|LIB"
 __attribute__((weak, unused))
-bool StringBeginWith(const std::string& str, const std::string& prefix) {
-    for (const auto& x : StringSplit(prefix, '|')) {
-        if (x.size() > str.size()) continue;
-        if (std::equal(x.begin(), x.end(), str.begin())) return true;
-    }
-    return false;
+bool StringBeginWith(std::string_view str, std::string_view prefix) {
+    return StringSplitForEach(prefix, '|', [str](std::string_view x) {
+        return x.size() <= str.size() && 0 == str.compare(0, x.size(), x);
+    });
 }
 
 //old_suffix support multiple matches split by '|', such as: ".cc|.cpp"
 __attribute__((weak, unused))
 std::string StringReplaceSuffix(const std::string& str, const std::string& old_suffix, const std::string& new_suffix) {
-    for (const auto& x : StringSplit(old_suffix, '|')) {
-        auto p = str.rfind(x);
-        if (std::string::npos == p || p + x.size() != str.size()) continue;
-        return str.substr(0, p) + new_suffix;
-    }
-    return str;
+    std::string result = str;
+    StringSplitForEach(old_suffix, '|', [&](std::string_view x) {
+        if (x.size() > str.size() || 0 != str.compare(str.size() - x.size(), x.size(), x)) return false;
+        result.replace(str.size() - x.size(), x.size(), new_suffix);
+        return true;
+    });
+    return result;
 }
 
 __attribute__((weak, unused))
@@ -280,6 +293,92 @@ std::string StringRightTrim(std::string str) {
     return str;
 }
 
+//incremental md5 calculator, and the hex digest is the same as the output of `md5sum`
+struct Md5 {
+    void Update(const char* data, size_t len) {
+        _len += len;
+        while (len > 0) {
+            size_t n = std::min(len, sizeof(_buf) - _buf_len);
+            memcpy(_buf + _buf_len, data, n);
+            _buf_len += n;
+            data += n;
+            len -= n;
+            if (sizeof(_buf) == _buf_len) {
+                Transform(_buf);
+                _buf_len = 0;
+            }
+        }
+    }
+    std::string HexDigest() {
+        uint64_t bit_len = _len * 8;
+        unsigned char pad[72] = {0x80};
+        Update((const char*)pad, (_buf_len < 56 ? 56 : 120) - _buf_len);
+        for (int i = 0; i < 8; ++i) pad[i] = (unsigned char)(bit_len >> (8 * i));
+        Update((const char*)pad, 8);
+        char hex[33];
+        for (int i = 0; i < 16; ++i) snprintf(hex + i * 2, 3, "%02x", (_h[i / 4] >> (8 * (i % 4))) & 0xff);
+        return std::string(hex, 32);
+    }
+
+private:
+    void Transform(const unsigned char* block) {
+        static const uint32_t s_k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const uint32_t s_r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+        uint32_t w[16];
+        for (int i = 0; i < 16; ++i) {
+            const auto* p = block + i * 4;
+            w[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+        uint32_t a = _h[0], b = _h[1], c = _h[2], d = _h[3];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t f = 0, g = 0;
+            if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+            else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+            else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) % 16; }
+            else             { f = c ^ (b | ~d);       g = (7 * i) % 16; }
+            uint32_t tmp = d;
+            d = c;
+            c = b;
+            uint32_t x = a + f + s_k[i] + w[g];
+            uint32_t s = s_r[(i / 16) * 4 + i % 4];
+            b += (x << s) | (x >> (32 - s));
+            a = tmp;
+        }
+        _h[0] += a; _h[1] += b; _h[2] += c; _h[3] += d;
+    }
+
+    uint32_t _h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    unsigned char _buf[64];
+    size_t _buf_len = 0;
+    uint64_t _len = 0;
+};
+
+__attribute__((weak, unused))
+std::string StringMd5(const std::string& str) {
+    Md5 md5;
+    md5.Update(str.data(), str.size());
+    return md5.HexDigest();
+}
+
+//return "" if the file can't be read
+__attribute__((weak, unused))
+std::string FileMd5(const std::string& filename) {
+    std::ifstream f(filename, std::ios::binary);
+    if (!f.is_open()) return "";
+    Md5 md5;
+    char buf[64 * 1024];
+    while (f.read(buf, sizeof(buf)) || f.gcount() > 0) md5.Update(buf, f.gcount());
+    return md5.HexDigest();
+}
+
 __attribute__((weak, unused))
 std::vector<std::string> ListFilesUnderDir(const std::string& path = ".",
         const std::string& filename_regex_filter = "", bool recursive = false,